@@ -0,0 +1,131 @@
+/* Lookup throughput of object_map against the mutex protected
+ * unordered_map it replaced, from 1 up to N threads.
+ *
+ *    bench_object_map [threads] [objects] [lookups per thread]
+ *
+ * Keys look like the heap pointers the layer maps. A writer thread keeps
+ * creating and destroying objects during the run, as the application does,
+ * so object_map also goes through its rebuilds.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "object_map.h"
+
+typedef std::lock_guard<std::mutex> scoped_lock;
+
+/* The layer's map before object_map */
+struct locked_map {
+   std::mutex lock;
+   std::unordered_map<uint64_t, void *> map;
+
+   void *find(uint64_t key)
+   {
+      scoped_lock lk(lock);
+      return map[key];
+   }
+
+   void insert(uint64_t key, void *value)
+   {
+      scoped_lock lk(lock);
+      map[key] = value;
+   }
+
+   void erase(uint64_t key)
+   {
+      scoped_lock lk(lock);
+      map.erase(key);
+   }
+};
+
+static uint64_t object_key(unsigned i)
+{
+   return 0x7f0000000000ull + i * 64ull;
+}
+
+/* ns per lookup, averaged over the reading threads */
+template <typename Map>
+static double run(unsigned n_threads, unsigned n_objects, unsigned n_lookups)
+{
+   Map map;
+   for (unsigned i = 0; i < n_objects; i++)
+      map.insert(object_key(i), (void *)(uintptr_t)(i + 1));
+
+   std::atomic<bool> go(false), done(false);
+   std::atomic<unsigned> misses(0);
+   std::vector<double> ns(n_threads);
+   std::vector<std::thread> readers;
+
+   for (unsigned t = 0; t < n_threads; t++) {
+      readers.emplace_back([&, t]() {
+         uint32_t seed = t * 2654435761u + 1;
+         unsigned missed = 0;
+         while (!go)
+            ;
+         auto start = std::chrono::steady_clock::now();
+         for (unsigned i = 0; i < n_lookups; i++) {
+            seed = seed * 1664525u + 1013904223u;
+            if (!map.find(object_key(seed % n_objects)))
+               missed++;
+         }
+         auto end = std::chrono::steady_clock::now();
+         ns[t] = std::chrono::duration<double, std::nano>(end - start).count() / n_lookups;
+         misses += missed;
+      });
+   }
+
+   /* Churns objects past the mapped ones, the looked up ones stay */
+   std::thread writer([&]() {
+      unsigned i = 0;
+      while (!go)
+         ;
+      while (!done) {
+         map.insert(object_key(n_objects + i), (void *)(uintptr_t)1);
+         if (i >= 64)
+            map.erase(object_key(n_objects + i - 64));
+         i++;
+      }
+   });
+
+   go = true;
+   for (auto &thread : readers)
+      thread.join();
+   done = true;
+   writer.join();
+
+   if (misses)
+      fprintf(stderr, "%u lookups missed\n", misses.load());
+
+   double total = 0;
+   for (double v : ns)
+      total += v;
+   return total / n_threads;
+}
+
+int main(int argc, char **argv)
+{
+   unsigned n_threads = argc > 1 ? atoi(argv[1]) : std::thread::hardware_concurrency();
+   unsigned n_objects = argc > 2 ? atoi(argv[2]) : 4096;
+   unsigned n_lookups = argc > 3 ? atoi(argv[3]) : 1000000;
+   if (!n_threads || !n_objects || !n_lookups) {
+      fprintf(stderr, "usage: %s [threads] [objects] [lookups per thread]\n", argv[0]);
+      return 1;
+   }
+
+   printf("%u objects, %u lookups per thread, ns per lookup\n", n_objects, n_lookups);
+   printf("threads  mutex  object_map\n");
+   for (unsigned t = 1;; t = t * 2 < n_threads ? t * 2 : n_threads) {
+      double locked = run<locked_map>(t, n_objects, n_lookups);
+      double lock_free = run<object_map>(t, n_objects, n_lookups);
+      printf("%7u  %5.1f  %10.1f\n", t, locked, lock_free);
+      if (t == n_threads)
+         break;
+   }
+   return 0;
+}
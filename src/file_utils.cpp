@@ -8,6 +8,7 @@
 #include <iostream>
 #include <fstream>
 #include <cstring>
+#include <cerrno>
 
 std::string read_line(const std::string& filename)
 {
@@ -100,6 +101,21 @@ bool dir_exists(const std::string& path)
     return !stat(path.c_str(), &s) && S_ISDIR(s.st_mode);
 }
 
+// Like mkdir -p, true if 'path' is a directory afterwards
+bool make_dirs(const std::string& path)
+{
+    if (path.empty() || dir_exists(path))
+        return true;
+
+    auto parent = path.find_last_of('/');
+    if (parent != std::string::npos && parent > 0 &&
+        !make_dirs(path.substr(0, parent)))
+        return false;
+
+    // Someone else may have created it meanwhile
+    return !mkdir(path.c_str(), 0755) || errno == EEXIST;
+}
+
 std::string readlink(const char * link)
 {
     char result[PATH_MAX] {};
@@ -172,3 +188,15 @@ std::string get_config_dir()
         path += "/.config";
     return path;
 }
+
+std::string get_cache_dir()
+{
+    const char* p = getenv("XDG_CACHE_HOME");
+    if (p)
+        return p;
+
+    std::string path = get_home_dir();
+    if (!path.empty())
+        path += "/.cache";
+    return path;
+}
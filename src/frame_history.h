@@ -0,0 +1,131 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+
+/* Per-frame values of the last frames, for the HUD graphs.
+ *
+ * Each of the N series is its own ring of floats (structure of arrays) so
+ * a graph reads one series straight from memory. Rings hold a power of
+ * two number of frames and every value is stored twice, at its slot and
+ * one capacity further, which keeps the last capacity() frames contiguous
+ * whatever the write position. Min, max and average over those frames
+ * are maintained on push: the sum incrementally, min and max with queues
+ * of the frames that may still become the extreme, so each push is
+ * amortized O(1) however long the history.
+ */
+template <unsigned N>
+class frame_history
+{
+public:
+   frame_history() : n_frames(0), mask(0) {}
+
+   /* Rounds 'frames' up to a power of two, the history restarts if that
+    * changes the capacity.
+    */
+   void set_length(uint32_t frames)
+   {
+      uint32_t capacity = 1;
+      while (capacity < frames)
+         capacity *= 2;
+      if (capacity == this->capacity())
+         return;
+
+      n_frames = 0;
+      mask = capacity - 1;
+      for (auto& s : series) {
+         s.ring.assign(2 * capacity, 0.0f);
+         s.sum = 0.0;
+         s.min.frames.assign(capacity, 0);
+         s.min.head = s.min.tail = 0;
+         s.max.frames.assign(capacity, 0);
+         s.max.head = s.max.tail = 0;
+      }
+   }
+
+   uint32_t capacity() const { return series[0].ring.size() / 2; }
+
+   /* Frames in the history, at most capacity() */
+   uint32_t size() const { return n_frames < capacity() ? n_frames : capacity(); }
+
+   /* One value per series */
+   void push(const float values[N])
+   {
+      const uint64_t frame = n_frames++;
+      const uint32_t slot = frame & mask;
+
+      for (unsigned i = 0; i < N; i++) {
+         struct series& s = series[i];
+         const float v = values[i];
+
+         if (frame > mask) {
+            /* Drops the frame leaving the history, it used this slot */
+            uint64_t evicted = frame - mask - 1;
+            s.sum -= s.ring[slot];
+            if (s.min.tail > s.min.head && s.min.frames[s.min.head & mask] == evicted)
+               s.min.head++;
+            if (s.max.tail > s.max.head && s.max.frames[s.max.head & mask] == evicted)
+               s.max.head++;
+         }
+
+         s.ring[slot] = s.ring[slot + mask + 1] = v;
+         s.sum += v;
+         push_extreme(s.min, s.ring, frame, v, false);
+         push_extreme(s.max, s.ring, frame, v, true);
+      }
+   }
+
+   /* The last capacity() frames of a series, oldest first. Frames not
+    * pushed yet read as 0.
+    */
+   const float *values(unsigned i) const
+   {
+      return series[i].ring.data() + (n_frames & mask);
+   }
+
+   float last(unsigned i) const
+   {
+      return n_frames ? series[i].ring[(n_frames - 1) & mask] : 0.0f;
+   }
+
+   float min(unsigned i) const { return extreme(series[i].min, series[i].ring); }
+   float max(unsigned i) const { return extreme(series[i].max, series[i].ring); }
+   float avg(unsigned i) const { return size() ? series[i].sum / size() : 0.0f; }
+
+private:
+   /* Frames in increasing order whose values strictly decrease (max) or
+    * increase (min), the front is the extreme. A ring of capacity() frames
+    * with monotonic head and tail.
+    */
+   struct extreme_queue {
+      std::vector<uint64_t> frames;
+      uint64_t head, tail;
+   };
+
+   struct series {
+      std::vector<float> ring;
+      double sum;
+      struct extreme_queue min, max;
+   };
+
+   void push_extreme(struct extreme_queue& q, const std::vector<float>& ring,
+                     uint64_t frame, float v, bool keep_max)
+   {
+      /* Frames no better than the new one can't be the extreme anymore */
+      while (q.tail > q.head) {
+         float back = ring[q.frames[(q.tail - 1) & mask] & mask];
+         if (keep_max ? back > v : back < v)
+            break;
+         q.tail--;
+      }
+      q.frames[q.tail++ & mask] = frame;
+   }
+
+   float extreme(const struct extreme_queue& q, const std::vector<float>& ring) const
+   {
+      return q.tail > q.head ? ring[q.frames[q.head & mask] & mask] : 0.0f;
+   }
+
+   struct series series[N];
+   uint64_t n_frames;
+   uint32_t mask;
+};
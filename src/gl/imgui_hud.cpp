@@ -5,7 +5,6 @@
 #include <iostream>
 #include <memory>
 #include <imgui.h>
-#include "font_default.h"
 #include "cpu.h"
 #include "file_utils.h"
 #include "imgui_hud.h"
@@ -46,6 +45,13 @@ struct state {
     ImGuiContext *imgui_ctx = nullptr;
     ImFont* font = nullptr;
     ImFont* font1 = nullptr;
+
+    // HUD rendered offscreen, see hud_refresh_rate
+    GLuint hud_fbo = 0, hud_texture = 0;
+    unsigned hud_width = 0, hud_height = 0;
+    uint64_t hud_hash = 0;
+    uint64_t last_hud_refresh = 0;
+    hud_quad quad;
 };
 
 static GLVec last_vp {}, last_sb {};
@@ -107,7 +113,7 @@ void imgui_create(void *ctx)
     // Setup Dear ImGui context
     IMGUI_CHECKVERSION();
     ImGuiContext *saved_ctx = ImGui::GetCurrentContext();
-    state.imgui_ctx = ImGui::CreateContext();
+    state.imgui_ctx = ImGui::CreateContext(get_shared_font_atlas(params, &state.font, &state.font1));
     ImGuiIO& io = ImGui::GetIO(); (void)io;
     //io.ConfigFlags |= ImGuiConfigFlags_NavEnableKeyboard;     // Enable Keyboard Controls
     //io.ConfigFlags |= ImGuiConfigFlags_NavEnableGamepad;      // Enable Gamepad Controls
@@ -130,27 +136,66 @@ void imgui_create(void *ctx)
     GLint current_texture;
     glGetIntegerv(GL_TEXTURE_BINDING_2D, &current_texture);
 
-    int font_size = params.font_size;
-    if (!font_size)
-        font_size = 24;
-
-    if (!params.font_file.empty() && file_exists(params.font_file)) {
-        state.font = io.Fonts->AddFontFromFileTTF(params.font_file.c_str(), font_size);
-        state.font1 = io.Fonts->AddFontFromFileTTF(params.font_file.c_str(), font_size * 0.55f);
-    } else {
-        ImFontConfig font_cfg = ImFontConfig();
-        const char* ttf_compressed_base85 = GetDefaultCompressedFontDataTTFBase85();
-        const ImWchar* glyph_ranges = io.Fonts->GetGlyphRangesDefault();
-
-        state.font = io.Fonts->AddFontFromMemoryCompressedBase85TTF(ttf_compressed_base85, font_size, &font_cfg, glyph_ranges);
-        state.font1 = io.Fonts->AddFontFromMemoryCompressedBase85TTF(ttf_compressed_base85, font_size * 0.55, &font_cfg, glyph_ranges);
-    }
     sw_stats.font1 = state.font1;
 
     // Restore global context or ours might clash with apps that use Dear ImGui
     ImGui::SetCurrentContext(saved_ctx);
 }
 
+static void destroy_hud_texture()
+{
+    if (state.hud_fbo)
+        glDeleteFramebuffers(1, &state.hud_fbo);
+    if (state.hud_texture)
+        glDeleteTextures(1, &state.hud_texture);
+    state.hud_fbo = state.hud_texture = 0;
+    state.hud_width = state.hud_height = 0;
+    state.hud_hash = 0;
+}
+
+// Renders the HUD into the offscreen texture that state.quad blends over
+// the following frames
+static void render_hud_texture(ImDrawData *draw_data, unsigned int width, unsigned int height)
+{
+    GLint last_texture; glGetIntegerv(GL_TEXTURE_BINDING_2D, &last_texture);
+    GLint last_framebuffer; glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &last_framebuffer);
+
+    if (width != state.hud_width || height != state.hud_height) {
+        destroy_hud_texture();
+
+        glGenTextures(1, &state.hud_texture);
+        glBindTexture(GL_TEXTURE_2D, state.hud_texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+        glGenFramebuffers(1, &state.hud_fbo);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, state.hud_fbo);
+        glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, state.hud_texture, 0);
+
+        state.hud_width = width;
+        state.hud_height = height;
+    }
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, state.hud_fbo);
+
+    GLfloat last_clear_color[4]; glGetFloatv(GL_COLOR_CLEAR_VALUE, last_clear_color);
+    GLboolean last_enable_scissor_test = glIsEnabled(GL_SCISSOR_TEST);
+    glDisable(GL_SCISSOR_TEST);
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+    glClearColor(last_clear_color[0], last_clear_color[1], last_clear_color[2], last_clear_color[3]);
+    if (last_enable_scissor_test)
+        glEnable(GL_SCISSOR_TEST);
+
+    ImGui_ImplOpenGL3_RenderDrawData(draw_data, ImGui_ImplOpenGL3_Blend_ToPremultiplied);
+
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, last_framebuffer);
+    glBindTexture(GL_TEXTURE_2D, last_texture);
+
+    // Texture rows start at the bottom
+    update_hud_quad(state.quad, draw_data, (ImTextureID)(intptr_t)state.hud_texture, true);
+}
+
 void imgui_shutdown()
 {
 #ifndef NDEBUG
@@ -159,6 +204,7 @@ void imgui_shutdown()
 
     if (state.imgui_ctx) {
         ImGui::SetCurrentContext(state.imgui_ctx);
+        destroy_hud_texture();
         ImGui_ImplOpenGL3_Shutdown();
         ImGui::DestroyContext(state.imgui_ctx);
         state.imgui_ctx = nullptr;
@@ -190,17 +236,39 @@ void imgui_render(unsigned int width, unsigned int height)
     ImGui::SetCurrentContext(state.imgui_ctx);
     ImGui::GetIO().DisplaySize = ImVec2(width, height);
 
-    ImGui_ImplOpenGL3_NewFrame();
-    ImGui::NewFrame();
-    {
-        std::lock_guard<std::mutex> lk(notifier.mutex);
-        position_layer(params, window_size);
-        render_imgui(sw_stats, params, window_size, false);
+    // Rendered offscreen, the HUD is only laid out again at hud_refresh_rate
+    // and every other frame blends the texture with a single quad.
+    bool offscreen = params.hud_refresh_rate && sw_stats.version_gl.major >= 3;
+    if (offscreen && (width != state.hud_width || height != state.hud_height))
+        state.last_hud_refresh = 0;
+
+    bool refresh = !offscreen || hud_refresh_due(params, state.last_hud_refresh);
+    if (refresh) {
+        ImGui_ImplOpenGL3_NewFrame();
+        ImGui::NewFrame();
+        {
+            std::lock_guard<std::mutex> lk(notifier.mutex);
+            position_layer(params, window_size);
+            render_imgui(sw_stats, params, window_size, false);
+        }
+        ImGui::PopStyleVar(3);
+
+        ImGui::Render();
     }
-    ImGui::PopStyleVar(3);
 
-    ImGui::Render();
-    ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+    ImDrawData *draw_data = ImGui::GetDrawData();
+    if (!offscreen) {
+        ImGui_ImplOpenGL3_RenderDrawData(draw_data);
+    } else if (draw_data) {
+        if (refresh) {
+            uint64_t hash = hash_draw_data(draw_data, 0);
+            if (hash != state.hud_hash || width != state.hud_width || height != state.hud_height) {
+                render_hud_texture(draw_data, width, height);
+                state.hud_hash = hash;
+            }
+        }
+        ImGui_ImplOpenGL3_RenderDrawData(&state.quad.draw_data, ImGui_ImplOpenGL3_Blend_Premultiplied);
+    }
     ImGui::SetCurrentContext(saved_ctx);
 }
 
@@ -31,7 +31,15 @@ void GetOpenGLVersion(int& major, int& minor, bool& isGLES);
 IMGUI_IMPL_API bool     ImGui_ImplOpenGL3_Init(const char* glsl_version = nullptr);
 IMGUI_IMPL_API void     ImGui_ImplOpenGL3_Shutdown();
 IMGUI_IMPL_API void     ImGui_ImplOpenGL3_NewFrame();
-IMGUI_IMPL_API void     ImGui_ImplOpenGL3_RenderDrawData(ImDrawData* draw_data);
+// How draw data is blended with the framebuffer
+enum ImGui_ImplOpenGL3_Blend
+{
+    ImGui_ImplOpenGL3_Blend_Default,            // Straight alpha
+    ImGui_ImplOpenGL3_Blend_ToPremultiplied,    // Straight alpha into a cleared offscreen target, which ends up premultiplied
+    ImGui_ImplOpenGL3_Blend_Premultiplied,      // Premultiplied alpha, e.g. a texture from the above
+};
+
+IMGUI_IMPL_API void     ImGui_ImplOpenGL3_RenderDrawData(ImDrawData* draw_data, ImGui_ImplOpenGL3_Blend blend = ImGui_ImplOpenGL3_Blend_Default);
 
 // (Optional) Called by Init/NewFrame/Shutdown
 //IMGUI_IMPL_API bool     ImGui_ImplOpenGL3_CreateFontsTexture();
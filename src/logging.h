@@ -5,6 +5,7 @@
 #include <thread>
 
 #include "mesa/util/os_time.h"
+#include "overlay_params.h"
 
 using namespace std;
 
@@ -20,8 +21,63 @@ struct logData{
   int cpu;
   int gpu;
   int previous;
+  uint64_t gpu_frametime;
+  uint64_t present_latency;
+  const char *bound;
+  uint64_t compile_time;
+  uint64_t process_vram;
+  float heap_pressure;
+  double allocations_per_sec;
+  uint64_t driver_time;
+  uint64_t n_submits;
+  uint64_t n_command_buffers;
+  uint64_t n_draws;
+  uint64_t n_dispatches;
+  uint64_t n_pipeline_binds;
+  uint64_t gpu_wait_time;
+  uint64_t render_thread_wait;
+  uint64_t frames_ahead_wait;
+  uint64_t display_interval;
+  int64_t present_error;
+  uint64_t layer_cpu_time;
+  uint64_t layer_gpu_time;
+  uint64_t layer_host_memory;
+  uint64_t layer_device_memory;
+  unsigned layer_cmd_reuse;
 };
 
+/* Optional groups of columns, each logged only when its option is on */
+enum log_column {
+	LOG_GPU_FRAMETIME,
+	LOG_PRESENT_LATENCY,
+	LOG_BOUND_BY,
+	LOG_COMPILE_STATS,
+	LOG_PROCESS_VRAM,
+	LOG_SUBMIT_STATS,
+	LOG_DRAW_STATS,
+	LOG_WAIT_STATS,
+	LOG_FRAMES_AHEAD,
+	LOG_DISPLAY_TIMING,
+	LOG_SELF_OVERHEAD,
+	LOG_COLUMN_COUNT
+};
+
+const char *log_column_names[LOG_COLUMN_COUNT] = {
+	"gpu_frametime",
+	"present_latency",
+	"bound_by",
+	"compile_time",
+	"process_vram,heap_pressure,allocations_per_sec",
+	"driver_time,submits,command_buffers",
+	"draws,dispatches,pipeline_binds",
+	"gpu_wait_time,render_thread_wait",
+	"frames_ahead_wait",
+	"display_interval,present_error",
+	"layer_cpu_time,layer_gpu_time,layer_host_memory,layer_device_memory,layer_cmd_reuse",
+};
+
+bool log_columns[LOG_COLUMN_COUNT];
+
 double fps;
 /*
 std::vector<logData> logArray;
@@ -56,7 +112,7 @@ int num;
 bool loggingOn;
 uint64_t log_start;
 
-ofstream create_file(string filename)
+ofstream create_file(const struct overlay_params& params)
 {
 	time_t now_log = time(0);
 	tm *log_time = localtime(&now_log);
@@ -69,10 +125,28 @@ ofstream create_file(string filename)
 		to_string(1 + log_time->tm_hour) + "-" +
 		to_string(1 + log_time->tm_min) + "-" +
 		to_string(1 + log_time->tm_sec);
-	new_file.open(filename + date, ios::out | ios::app);
+	new_file.open(params.output_file + date, ios::out | ios::app);
 	new_file << "os," << "cpu," << "gpu," << "ram," << "kernel," << "driver" << endl;
 	new_file << os << "," << cpu << "," << gpu << "," << ram << "," << kernel << "," << driver << endl;
 
+	log_columns[LOG_GPU_FRAMETIME] = params.gpu_frametime;
+	log_columns[LOG_PRESENT_LATENCY] = params.present_latency;
+	log_columns[LOG_BOUND_BY] = params.bound_by;
+	log_columns[LOG_COMPILE_STATS] = params.compile_stats;
+	log_columns[LOG_PROCESS_VRAM] = params.process_vram;
+	log_columns[LOG_SUBMIT_STATS] = params.submit_stats;
+	log_columns[LOG_DRAW_STATS] = params.draw_stats;
+	log_columns[LOG_WAIT_STATS] = params.wait_stats;
+	log_columns[LOG_FRAMES_AHEAD] = params.max_frames_ahead > 0;
+	log_columns[LOG_DISPLAY_TIMING] = params.display_timing;
+	log_columns[LOG_SELF_OVERHEAD] = params.self_overhead;
+
+	new_file << "frametime,fps,cpu_load,gpu_load,elapsed";
+	for (int i = 0; i < LOG_COLUMN_COUNT; i++)
+		if (log_columns[i])
+			new_file << "," << log_column_names[i];
+	new_file << endl;
+
 	return new_file;
 }
 
@@ -81,10 +155,40 @@ void write_file(void *param)
 	unsigned int size = log_size;
 	ofstream *file = static_cast<ofstream *>(param);
 
-	for (size_t i = 0; i < size; i++)
-		*file << read_buffer[i].frametime << "," << read_buffer[i].fps << ","
-		    << read_buffer[i].cpu  << "," << read_buffer[i].gpu << ","
-		    << read_buffer[i].previous << endl;
+	for (size_t i = 0; i < size; i++) {
+		const logData& d = read_buffer[i];
+		*file << d.frametime << "," << d.fps << ","
+		    << d.cpu  << "," << d.gpu << ","
+		    << d.previous;
+		if (log_columns[LOG_GPU_FRAMETIME])
+			*file << "," << d.gpu_frametime;
+		if (log_columns[LOG_PRESENT_LATENCY])
+			*file << "," << d.present_latency;
+		if (log_columns[LOG_BOUND_BY])
+			*file << "," << d.bound;
+		if (log_columns[LOG_COMPILE_STATS])
+			*file << "," << d.compile_time;
+		if (log_columns[LOG_PROCESS_VRAM])
+			*file << "," << d.process_vram << "," << d.heap_pressure
+			      << "," << d.allocations_per_sec;
+		if (log_columns[LOG_SUBMIT_STATS])
+			*file << "," << d.driver_time << "," << d.n_submits
+			      << "," << d.n_command_buffers;
+		if (log_columns[LOG_DRAW_STATS])
+			*file << "," << d.n_draws << "," << d.n_dispatches
+			      << "," << d.n_pipeline_binds;
+		if (log_columns[LOG_WAIT_STATS])
+			*file << "," << d.gpu_wait_time << "," << d.render_thread_wait;
+		if (log_columns[LOG_FRAMES_AHEAD])
+			*file << "," << d.frames_ahead_wait;
+		if (log_columns[LOG_DISPLAY_TIMING])
+			*file << "," << d.display_interval << "," << d.present_error;
+		if (log_columns[LOG_SELF_OVERHEAD])
+			*file << "," << d.layer_cpu_time << "," << d.layer_gpu_time
+			      << "," << d.layer_host_memory << "," << d.layer_device_memory
+			      << "," << d.layer_cmd_reuse;
+		*file << endl;
+	}
 
 	log_size = 0;
 }
@@ -0,0 +1,271 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <utility>
+
+/* Maps Vulkan handles to the layer's per-object data.
+ *
+ * Every hooked entry point looks up its object here, often from several
+ * submitting threads at once, while inserts and removals only happen on
+ * object creation and destruction. Lookups are therefore lock-free: the
+ * table is open-addressed (linear probing) and published through an atomic
+ * pointer. Writers serialize on a mutex, removals leave a tombstone that a
+ * later insert may reuse, and when the table fills up it is rebuilt into a
+ * fresh one. Readers may still be walking the old table at that point:
+ * each reading thread announces the table it walks in its own hazard
+ * slot, and a retired table is freed by a later rebuild once no slot
+ * holds it anymore. Slots are found through a small thread_local cache
+ * keyed by the map's id, like thread_counters, and are only freed with the
+ * map; threads that exit leave theirs cleared.
+ */
+class object_map
+{
+public:
+   object_map() : id(next_id()), hazards(nullptr)
+   {
+      table.store(new_table(min_capacity), std::memory_order_release);
+   }
+
+   ~object_map()
+   {
+      delete_table(table.load(std::memory_order_relaxed));
+      for (auto t : retired)
+         delete_table(t);
+      for (struct hazard *h = hazards.load(std::memory_order_relaxed), *next; h; h = next) {
+         next = h->next;
+         delete h;
+      }
+   }
+
+   void *find(uint64_t key) const
+   {
+      struct hazard *h = local_hazard();
+      const struct slot_table *t = table.load(std::memory_order_acquire);
+
+      /* The table is safe to walk once it is still current after being
+       * announced, a rebuild retiring it later sees the announcement.
+       */
+      for (;;) {
+         h->table.store(t, std::memory_order_seq_cst);
+         const struct slot_table *current = table.load(std::memory_order_seq_cst);
+         if (current == t)
+            break;
+         t = current;
+      }
+
+      const uint32_t mask = t->capacity - 1;
+      void *value = nullptr;
+      for (uint32_t i = hash(key) & mask, n = 0; n < t->capacity; i = (i + 1) & mask, n++) {
+         uint64_t k = t->slots[i].key.load(std::memory_order_acquire);
+         if (k == key) {
+            value = t->slots[i].value.load(std::memory_order_acquire);
+            break;
+         }
+         if (k == empty_key)
+            break;
+      }
+
+      h->table.store(nullptr, std::memory_order_release);
+      return value;
+   }
+
+   void insert(uint64_t key, void *value)
+   {
+      std::lock_guard<std::mutex> lk(write_lock);
+      struct slot_table *t = table.load(std::memory_order_relaxed);
+
+      if ((t->used + 1) * 4 > t->capacity * 3) {
+         t = rebuild(t);
+         table.store(t, std::memory_order_seq_cst);
+         reclaim();
+      }
+
+      struct slot *s = lookup_slot(t, key);
+      uint64_t k = s->key.load(std::memory_order_relaxed);
+      if (k == empty_key)
+         t->used++;
+      if (s->value.load(std::memory_order_relaxed) == nullptr)
+         t->live++;
+
+      /* When taking over an empty slot or a tombstone, the value is
+       * published after the key so a reader matching the key sees either
+       * nullptr (object still being created) or the data.
+       */
+      if (k != key) {
+         s->value.store(nullptr, std::memory_order_relaxed);
+         s->key.store(key, std::memory_order_release);
+      }
+      s->value.store(value, std::memory_order_release);
+   }
+
+   void erase(uint64_t key)
+   {
+      std::lock_guard<std::mutex> lk(write_lock);
+      struct slot_table *t = table.load(std::memory_order_relaxed);
+      const uint32_t mask = t->capacity - 1;
+
+      for (uint32_t i = hash(key) & mask, n = 0; n < t->capacity; i = (i + 1) & mask, n++) {
+         uint64_t k = t->slots[i].key.load(std::memory_order_relaxed);
+         if (k == empty_key)
+            return;
+         if (k == key) {
+            /* Leave the key in place as a tombstone so probe chains going
+             * through this slot stay intact for concurrent readers.
+             */
+            if (t->slots[i].value.exchange(nullptr, std::memory_order_release))
+               t->live--;
+            return;
+         }
+      }
+   }
+
+private:
+   /* Handles are never 0, VK_NULL_HANDLE lookups just miss */
+   static constexpr uint64_t empty_key = 0;
+   static constexpr uint32_t min_capacity = 256;
+
+   struct slot {
+      std::atomic<uint64_t> key;
+      std::atomic<void *> value;
+   };
+
+   struct slot_table {
+      uint32_t capacity; /* power of two */
+      uint32_t used;     /* slots holding a key, tombstones included */
+      uint32_t live;     /* slots holding a value */
+      struct slot *slots;
+   };
+
+   /* The table a thread is walking, nullptr between lookups */
+   struct hazard {
+      std::atomic<const struct slot_table *> table;
+      struct hazard *next;
+   };
+
+   static uint64_t next_id()
+   {
+      static std::atomic<uint64_t> ids;
+      return ++ids;
+   }
+
+   struct hazard *local_hazard() const
+   {
+      static thread_local std::vector<std::pair<uint64_t, struct hazard *>> cache;
+      for (auto &entry : cache) {
+         if (entry.first == id)
+            return entry.second;
+      }
+
+      struct hazard *h = new hazard();
+      h->table.store(nullptr, std::memory_order_relaxed);
+      h->next = hazards.load(std::memory_order_relaxed);
+      while (!hazards.compare_exchange_weak(h->next, h, std::memory_order_release,
+                                            std::memory_order_relaxed))
+         ;
+      cache.emplace_back(id, h);
+      return h;
+   }
+
+   static uint32_t hash(uint64_t key)
+   {
+      /* Handles are mostly heap pointers, mix the low bits away */
+      key ^= key >> 33;
+      key *= 0xff51afd7ed558ccdull;
+      key ^= key >> 33;
+      return (uint32_t)key;
+   }
+
+   static struct slot_table *new_table(uint32_t capacity)
+   {
+      struct slot_table *t = new slot_table();
+      t->capacity = capacity;
+      t->slots = new slot[capacity];
+      for (uint32_t i = 0; i < capacity; i++) {
+         t->slots[i].key.store(empty_key, std::memory_order_relaxed);
+         t->slots[i].value.store(nullptr, std::memory_order_relaxed);
+      }
+      return t;
+   }
+
+   static void delete_table(struct slot_table *t)
+   {
+      delete[] t->slots;
+      delete t;
+   }
+
+   /* Slot holding 'key', else the first tombstone on its probe chain, else
+    * the empty slot terminating the chain. Called with write_lock held and
+    * with at least one empty slot left in the table.
+    */
+   static struct slot *lookup_slot(struct slot_table *t, uint64_t key)
+   {
+      const uint32_t mask = t->capacity - 1;
+      struct slot *tombstone = nullptr;
+
+      for (uint32_t i = hash(key) & mask;; i = (i + 1) & mask) {
+         struct slot *s = &t->slots[i];
+         uint64_t k = s->key.load(std::memory_order_relaxed);
+         if (k == key)
+            return s;
+         if (k == empty_key)
+            return tombstone ? tombstone : s;
+         if (!tombstone && s->value.load(std::memory_order_relaxed) == nullptr)
+            tombstone = s;
+      }
+   }
+
+   struct slot_table *rebuild(struct slot_table *old)
+   {
+      uint32_t capacity = min_capacity;
+      while (capacity < old->live * 4)
+         capacity *= 2;
+
+      struct slot_table *t = new_table(capacity);
+      for (uint32_t i = 0; i < old->capacity; i++) {
+         void *value = old->slots[i].value.load(std::memory_order_relaxed);
+         if (!value)
+            continue;
+         uint64_t key = old->slots[i].key.load(std::memory_order_relaxed);
+         struct slot *s = lookup_slot(t, key);
+         s->key.store(key, std::memory_order_relaxed);
+         s->value.store(value, std::memory_order_relaxed);
+         t->used++;
+         t->live++;
+      }
+
+      retired.push_back(old);
+      return t;
+   }
+
+   /* Frees the retired tables no reader announced. Called with write_lock
+    * held, after a new table was published: readers announcing a retired
+    * one after this scan will find it isn't current and move on.
+    */
+   void reclaim()
+   {
+      auto it = retired.begin();
+      while (it != retired.end()) {
+         bool in_use = false;
+         for (struct hazard *h = hazards.load(std::memory_order_acquire); h; h = h->next) {
+            if (h->table.load(std::memory_order_seq_cst) == *it) {
+               in_use = true;
+               break;
+            }
+         }
+         if (in_use) {
+            ++it;
+         } else {
+            delete_table(*it);
+            it = retired.erase(it);
+         }
+      }
+   }
+
+   const uint64_t id;
+   std::atomic<struct slot_table *> table;
+   std::vector<struct slot_table *> retired;
+   mutable std::atomic<struct hazard *> hazards;
+   std::mutex write_lock;
+};
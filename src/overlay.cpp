@@ -23,13 +23,18 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 #include <assert.h>
 #include <thread>
 #include <chrono>
 #include <unordered_map>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <vector>
-#include <list>
+#include <deque>
+#include <map>
+#include <cmath>
 
 #include <sys/types.h>
 #include <unistd.h>
@@ -61,6 +66,8 @@
 #include "memory.h"
 #include "notify.h"
 #include "blacklist.h"
+#include "object_map.h"
+#include "thread_counters.h"
 #include "version.h"
 
 #ifdef HAVE_DBUS
@@ -97,10 +104,92 @@ struct instance_data {
 
    string engineName, engineVersion;
    notify_thread notifier;
+
+   /* vkGetPhysicalDeviceFeatures2 and friends are usable, which device
+    * extensions the layer enables for itself may depend on.
+    */
+   bool properties2;
+   uint32_t api_version;
+};
+
+/* Optional hook groups. overlay_GetDeviceProcAddr only hands out the hooks
+ * of a group when a feature enabled at vkCreateDevice time needs them,
+ * otherwise the application calls straight into the next layer.
+ */
+enum overlay_hooks {
+   OVERLAY_HOOKS_COMMAND_BUFFER = 1 << 0,
+   OVERLAY_HOOKS_QUEUE_SUBMIT = 1 << 1,
+   OVERLAY_HOOKS_ACQUIRE = 1 << 2,
+   OVERLAY_HOOKS_PIPELINE = 1 << 3,
+   OVERLAY_HOOKS_MEMORY = 1 << 4,
+   OVERLAY_HOOKS_DRAW = 1 << 5,
+   OVERLAY_HOOKS_WAIT = 1 << 6,
+};
+
+/* Device memory owned by the layer. All layer resources of a device are
+ * sub-allocated from a few of these, host visible blocks stay mapped.
+ */
+struct device_memory_block {
+   VkDeviceMemory memory;
+   VkDeviceSize size;
+   uint32_t type_index;
+   char *map;
+
+   std::map<VkDeviceSize, VkDeviceSize> free_ranges; /* offset -> size */
+};
+
+struct device_allocation {
+   struct device_memory_block *block;
+   VkDeviceSize offset;
+   VkDeviceSize size;
+   char *map; /* NULL unless host visible */
+};
+
+/* GPU copy of a shared font atlas, one per device and atlas */
+struct device_font {
+   ImFontAtlas *atlas;
+   VkImage image;
+   VkImageView image_view;
+   struct device_allocation mem;
+   bool uploaded; /* the upload has completed */
+};
+
+/* Commands recorded into a command buffer, for draw_stats */
+enum draw_counter {
+   DRAW_COUNTER_draws,
+   DRAW_COUNTER_dispatches,
+   DRAW_COUNTER_pipeline_binds,
+   DRAW_COUNTER_descriptor_binds,
+   DRAW_COUNTER_MAX,
+};
+
+/* Queue submission and present calls of the application, for submit_stats,
+ * and the draw_counter of the submitted command buffers for draw_stats.
+ * Times are of the downstream calls, in ns.
+ */
+enum submit_counter {
+   SUBMIT_COUNTER_submits,
+   SUBMIT_COUNTER_batches,
+   SUBMIT_COUNTER_command_buffers,
+   SUBMIT_COUNTER_submit_time,
+   SUBMIT_COUNTER_present_time,
+   SUBMIT_COUNTER_draws, /* first of DRAW_COUNTER_MAX, in draw_counter order */
+   SUBMIT_COUNTER_MAX = SUBMIT_COUNTER_draws + DRAW_COUNTER_MAX,
+};
+
+/* Host waits for the GPU, for wait_stats. Time in ns. */
+enum wait_counter {
+   WAIT_COUNTER_waits,
+   WAIT_COUNTER_wait_time,
+   WAIT_COUNTER_MAX,
 };
 
+/* ns the calling thread spent in those waits, across devices */
+static thread_local uint64_t thread_wait_ns;
+
 /* Mapped from VkDevice */
 struct queue_data;
+struct swapchain_data;
 struct device_data {
    struct instance_data *instance;
 
@@ -110,13 +199,79 @@ struct device_data {
    VkPhysicalDevice physical_device;
    VkDevice device;
 
+   uint32_t hooks; /* enum overlay_hooks */
+
    VkPhysicalDeviceProperties properties;
+   VkPhysicalDeviceMemoryProperties memory_properties;
+
+   /* VK_KHR_timeline_semaphore enabled by the layer or the application */
+   bool timeline_semaphore;
+   /* VK_KHR_present_id/present_wait enabled by the layer, which then
+    * owns vkWaitForPresentKHR on this device.
+    */
+   bool present_wait;
+   /* VK_EXT_pipeline_creation_feedback enabled, for compile_stats */
+   bool pipeline_feedback;
+   /* VK_GOOGLE_display_timing enabled, for display_timing */
+   bool display_timing;
+
+   /* Application pipelines created since the last present, compile_time
+    * in us includes shader modules. Updated from any thread.
+    */
+   std::atomic<uint32_t> n_pipelines, n_cache_hits;
+   std::atomic<uint64_t> compile_time;
+
+   /* Device memory the application holds, for process_vram */
+   std::atomic<uint64_t> heap_allocated[VK_MAX_MEMORY_HEAPS];
+   std::atomic<uint64_t> n_allocations; /* since device creation */
+   /* VK_EXT_memory_budget enabled, budgets are queried through this */
+   PFN_vkGetPhysicalDeviceMemoryProperties2 get_memory_properties2;
+
+   thread_counters<SUBMIT_COUNTER_MAX> submit_counters;
+   thread_counters<WAIT_COUNTER_MAX> wait_counters;
+
+   /* max_frames_ahead, the queue timeline and value each frame still in
+    * flight signals, oldest first. Only on with timeline semaphores.
+    */
+   bool frames_ahead;
+   std::deque<std::pair<VkSemaphore, uint64_t>> frames_in_flight;
+   std::mutex frames_ahead_lock;
+
+   /* headless frames are taken here until the application creates a
+    * swapchain. Only its stats are used, it has no swapchain nor any
+    * overlay resources.
+    */
+   struct swapchain_data *headless;
+   std::atomic<bool> has_swapchain;
+   std::mutex headless_lock;
+
+   std::mutex memory_lock;
+   std::vector<struct device_memory_block *> memory_blocks;
+   VkDeviceSize memory_allocated; /* Sum of memory_blocks sizes */
+
+   /* Shared by the pipelines of all swapchains and persisted to
+    * pipeline_cache_path, see load_pipeline_cache().
+    */
+   VkPipelineCache pipeline_cache;
+   std::string pipeline_cache_path;
+   size_t pipeline_cache_size; /* of the data on disk */
+   std::mutex pipeline_cache_lock;
+
+   std::mutex font_lock;
+   std::vector<struct device_font *> fonts;
 
    struct queue_data *graphic_queue;
 
    std::vector<struct queue_data *> queues;
 };
 
+/* Mapped from VkDeviceMemory allocated by the application */
+struct device_memory_data {
+   struct device_data *device;
+   uint32_t heap_index;
+   VkDeviceSize size;
+};
+
 /* Mapped from VkCommandBuffer */
 struct queue_data;
 struct command_buffer_data {
@@ -127,15 +282,48 @@ struct command_buffer_data {
    VkCommandBuffer cmd_buffer;
 
    struct queue_data *queue_data;
+
+   /* Recorded since the last begin. Recording is externally synchronized,
+    * so only ever touched by one thread at a time.
+    */
+   uint32_t counters[DRAW_COUNTER_MAX];
 };
 
 /* Mapped from VkQueue */
+/* Overlay work of one vkQueuePresentKHR, submitted together by
+ * submit_overlay_batch(). Lives in the presenting queue so the vectors keep
+ * their storage from one present to the next.
+ */
+struct overlay_batch {
+   std::vector<struct swapchain_data *> swapchains;
+   std::vector<struct overlay_draw *> draws;
+   std::vector<uint32_t> n_command_buffers; /* of each draw */
+   std::vector<VkCommandBuffer> command_buffers;
+   std::vector<VkPipelineStageFlags> stages_wait;
+   std::vector<VkSemaphore> signal_semaphores;
+   std::vector<uint64_t> signal_values;
+   std::vector<uint64_t> present_ids; /* of each presented swapchain */
+   std::vector<VkPresentTimeGOOGLE> present_times; /* likewise */
+};
+
 struct queue_data {
    struct device_data *device;
 
    VkQueue queue;
    VkQueueFlags flags;
    uint32_t family_index;
+   uint32_t timestamp_valid_bits;
+
+   struct overlay_batch batch;
+
+   /* Times the application's submissions, see gpu_frametime */
+   struct gpu_timer *gpu_timer;
+
+   /* Signaled after each present to this queue for max_frames_ahead. Work
+    * on different queues isn't ordered, so each queue has its own.
+    */
+   VkSemaphore frames_ahead_timeline;
+   uint64_t frames_ahead_value;
 };
 
 struct overlay_draw {
@@ -146,13 +334,30 @@ struct overlay_draw {
    VkSemaphore semaphore;
    VkFence fence;
 
-   VkBuffer vertex_buffer;
-   VkDeviceMemory vertex_buffer_mem;
-   VkDeviceSize vertex_buffer_size;
+   /* End of this draw's vertex/index data in swapchain_data::ring, the
+    * ring tail can move up to it once the draw has completed.
+    */
+   uint64_t ring_end;
+
+   /* Increments with every submission of the swapchain */
+   uint64_t serial;
+
+   /* Write the timestamps around the draw for self_overhead */
+   VkCommandBuffer timestamp_begin, timestamp_end;
+};
+
+/* Overlay commands recorded for one swapchain image. They are submitted
+ * again as long as the HUD geometry doesn't change.
+ */
+struct overlay_image_cache {
+   VkCommandBuffer command_buffer;
+   uint64_t hash;   /* of the recorded draw data, 0 if nothing recorded */
+   uint64_t serial; /* of the last draw submitting command_buffer */
 
-   VkBuffer index_buffer;
-   VkDeviceMemory index_buffer_mem;
-   VkDeviceSize index_buffer_size;
+   /* Vertex/index data read by command_buffer */
+   VkBuffer buffer;
+   struct device_allocation mem;
+   VkDeviceSize size;
 };
 
 /* Mapped from VkSwapchainKHR */
@@ -180,15 +385,96 @@ struct swapchain_data {
 
    VkCommandPool command_pool;
 
-   std::list<overlay_draw *> draws; /* List of struct overlay_draw */
+   /* Fixed pool, the draw with serial N lives in draws[N % draws.size()].
+    * Completion is tracked by 'timeline' reaching the serial if timeline
+    * semaphores are available, by each draw's fence otherwise.
+    */
+   std::vector<struct overlay_draw> draws;
+   VkSemaphore timeline;
+   uint64_t draw_serial;      /* of the last draw handed out */
+   uint64_t completed_serial; /* every draw up to this one has completed */
+   uint64_t n_draw_waits;     /* draws that had to wait for a free slot */
+
+   std::vector<struct overlay_image_cache> image_cache; /* per image */
+   uint64_t n_cmd_reused, n_cmd_recorded; /* frames, for self_overhead */
+
+   /* With hud_refresh_rate set at swapchain creation, the HUD is rendered
+    * into 'image' when it changes and blended over each frame as a quad.
+    */
+   struct {
+      VkImage image;
+      VkImageView image_view;
+      struct device_allocation mem;
+      VkRenderPass render_pass;
+      VkFramebuffer framebuffer;
+      VkPipeline pipeline;       /* renders the HUD into image */
+      VkPipeline blend_pipeline; /* blends image over swapchain images */
+      VkDescriptorSet descriptor_set;
+
+      struct overlay_image_cache cache; /* hash 0 until image has content */
+      uint64_t last_refresh;
+      bool dirty; /* laid out again since last checked against cache */
+      struct hud_quad quad;
+   } hud;
+
+   /* Vertex and index data of all in-flight draws, sub-allocated in
+    * submission order. head and tail are monotonic byte positions, the
+    * buffer offset is position % size.
+    */
+   struct {
+      VkBuffer buffer;
+      struct device_allocation mem;
+      VkDeviceSize size;
+      char *map;
+      uint64_t head;
+      uint64_t tail;
+   } ring;
 
    ImFont* font = nullptr;
-   bool font_uploaded;
-   VkImage font_image;
-   VkImageView font_image_view;
-   VkDeviceMemory font_mem;
-   VkBuffer upload_font_buffer;
-   VkDeviceMemory upload_font_buffer_mem;
+   bool font_uploaded; /* device_font is ready to sample */
+   struct device_font *device_font;
+
+   /* Tracks present latency when the device has present_wait */
+   struct present_waiter *present_waiter;
+
+   /* Replaced by a new swapchain that adopted the overlay state, see
+    * adopt_swapchain_data(). Images acquired before are still presented
+    * as they are, without overlay or stats.
+    */
+   bool retired;
+
+   /* us the application spent blocked in acquire and present since the
+    * last snapshot, for bound_by. Acquire may happen on another thread.
+    */
+   std::atomic<uint64_t> present_wait;
+
+   /* device submit_counters at the last present */
+   uint64_t last_submit_counters[SUBMIT_COUNTER_MAX];
+   /* device wait_counters and thread_wait_ns of the presenting thread at
+    * the last present
+    */
+   uint64_t last_wait_counters[WAIT_COUNTER_MAX];
+   uint64_t last_thread_wait;
+
+   /* us max_frames_ahead held the application since the last snapshot */
+   std::atomic<uint64_t> frames_ahead_wait;
+
+   /* display_timing pacing, times in ns. Not paced while
+    * refresh_duration is 0.
+    */
+   uint64_t refresh_duration;
+   uint32_t last_timing_id;
+   uint64_t last_target_refresh; /* the refresh the last present aimed at */
+   uint64_t last_actual_present;
+   std::vector<VkPastPresentationTimingGOOGLE> past_timings;
+
+   /* self_overhead. Each draw's timestamps are queries 2 * its index and
+    * the one after, no pool without timestamps on the graphic queue. CPU
+    * times are of the last present, ns.
+    */
+   VkQueryPool overhead_queries;
+   uint64_t overhead_read_serial; /* draw the GPU time was last read from */
+   uint64_t layer_cpu_time, layout_cpu_time;
 
    /**/
    ImGuiContext* imgui_context;
@@ -213,10 +499,12 @@ struct swapchain_data {
    struct frame_stat accumulated_stats;
 };
 
-// single global lock, for simplicity
-std::mutex global_lock;
 typedef std::lock_guard<std::mutex> scoped_lock;
-std::unordered_map<uint64_t, void *> vk_object_to_data;
+
+/* Lock-free on lookup, hooked entry points are called from every thread
+ * the application submits from.
+ */
+static object_map vk_object_to_data;
 
 thread_local ImGuiContext* __MesaImGui;
 
@@ -225,19 +513,16 @@ thread_local ImGuiContext* __MesaImGui;
 
 static void *find_object_data(uint64_t obj)
 {
-   scoped_lock lk(global_lock);
-   return vk_object_to_data[obj];
+   return vk_object_to_data.find(obj);
 }
 
 static void map_object(uint64_t obj, void *data)
 {
-   scoped_lock lk(global_lock);
-   vk_object_to_data[obj] = data;
+   vk_object_to_data.insert(obj, data);
 }
 
 static void unmap_object(uint64_t obj)
 {
-   scoped_lock lk(global_lock);
    vk_object_to_data.erase(obj);
 }
 
@@ -338,6 +623,7 @@ static struct queue_data *new_queue_data(VkQueue queue,
    data->queue = queue;
    data->flags = family_props->queueFlags;
    data->family_index = family_index;
+   data->timestamp_valid_bits = family_props->timestampValidBits;
    map_object(HKEY(data->queue), data);
 
    if (data->flags & VK_QUEUE_GRAPHICS_BIT)
@@ -437,51 +723,87 @@ static void destroy_swapchain_data(struct swapchain_data *data)
    delete data;
 }
 
-struct overlay_draw *get_overlay_draw(struct swapchain_data *data)
+static void free_device_memory(struct device_data *data,
+                               struct device_allocation *alloc);
+
+/* Called once the GPU is done with 'draw', may be called more than once */
+static void overlay_draw_complete(struct swapchain_data *data,
+                                  struct overlay_draw *draw)
 {
-   struct device_data *device_data = data->device;
-   struct overlay_draw *draw = data->draws.empty() ?
-      nullptr : data->draws.front();
+   data->ring.tail = std::max(data->ring.tail, draw->ring_end);
+}
 
-   VkSemaphoreCreateInfo sem_info = {};
-   sem_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+/* Polls how far the GPU got through the submitted draws */
+static void update_completed_serial(struct swapchain_data *data)
+{
+   struct device_data *device_data = data->device;
 
-   if (draw && device_data->vtable.GetFenceStatus(device_data->device, draw->fence) == VK_SUCCESS) {
-      VK_CHECK(device_data->vtable.ResetFences(device_data->device,
-                                               1, &draw->fence));
-      data->draws.pop_front();
-      data->draws.push_back(draw);
-      return draw;
+   if (data->timeline != VK_NULL_HANDLE) {
+      uint64_t value;
+      VK_CHECK(device_data->vtable.GetSemaphoreCounterValueKHR(device_data->device,
+                                                               data->timeline, &value));
+      data->completed_serial = value;
+      return;
    }
 
-   draw = new overlay_draw();
-
-   VkCommandBufferAllocateInfo cmd_buffer_info = {};
-   cmd_buffer_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-   cmd_buffer_info.commandPool = data->command_pool;
-   cmd_buffer_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-   cmd_buffer_info.commandBufferCount = 1;
-   VK_CHECK(device_data->vtable.AllocateCommandBuffers(device_data->device,
-                                                       &cmd_buffer_info,
-                                                       &draw->command_buffer));
-   VK_CHECK(device_data->set_device_loader_data(device_data->device,
-                                                draw->command_buffer));
+   /* Draws are submitted to the same queue, so they complete in order */
+   while (data->completed_serial < data->draw_serial) {
+      struct overlay_draw *draw =
+         &data->draws[(data->completed_serial + 1) % data->draws.size()];
+      if (device_data->vtable.GetFenceStatus(device_data->device, draw->fence) != VK_SUCCESS)
+         break;
+      data->completed_serial++;
+   }
+}
 
+/* Blocks until every draw up to 'serial' has completed */
+static void wait_overlay_draws(struct swapchain_data *data, uint64_t serial)
+{
+   struct device_data *device_data = data->device;
 
-   VkFenceCreateInfo fence_info = {};
-   fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-   VK_CHECK(device_data->vtable.CreateFence(device_data->device,
-                                            &fence_info,
-                                            NULL,
-                                            &draw->fence));
+   update_completed_serial(data);
+   if (data->completed_serial >= serial)
+      return;
 
-   VK_CHECK(device_data->vtable.CreateSemaphore(device_data->device, &sem_info,
-                                                NULL, &draw->semaphore));
-   VK_CHECK(device_data->vtable.CreateSemaphore(device_data->device, &sem_info,
-                                                NULL, &draw->cross_engine_semaphore));
+   if (data->timeline != VK_NULL_HANDLE) {
+      VkSemaphoreWaitInfoKHR wait_info = {};
+      wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO_KHR;
+      wait_info.semaphoreCount = 1;
+      wait_info.pSemaphores = &data->timeline;
+      wait_info.pValues = &serial;
+      VK_CHECK(device_data->vtable.WaitSemaphoresKHR(device_data->device,
+                                                     &wait_info, UINT64_MAX));
+   } else {
+      struct overlay_draw *draw = &data->draws[serial % data->draws.size()];
+      VK_CHECK(device_data->vtable.WaitForFences(device_data->device,
+                                                 1, &draw->fence,
+                                                 VK_TRUE, UINT64_MAX));
+   }
+   data->completed_serial = serial;
+}
 
-   data->draws.push_back(draw);
+struct overlay_draw *get_overlay_draw(struct swapchain_data *data)
+{
+   struct device_data *device_data = data->device;
+   uint64_t serial = data->draw_serial + 1;
+   struct overlay_draw *draw = &data->draws[serial % data->draws.size()];
+
+   if (draw->serial) {
+      update_completed_serial(data);
+      if (draw->serial > data->completed_serial) {
+         /* Every draw is in flight, this is where a growing pool would
+          * have allocated a new one.
+          */
+         data->n_draw_waits++;
+         wait_overlay_draws(data, draw->serial);
+      }
+      overlay_draw_complete(data, draw);
+      if (data->timeline == VK_NULL_HANDLE)
+         VK_CHECK(device_data->vtable.ResetFences(device_data->device,
+                                                  1, &draw->fence));
+   }
 
+   draw->serial = data->draw_serial = serial;
    return draw;
 }
 
@@ -895,7 +1217,7 @@ void check_keybinds(struct overlay_params& params){
        loggingOn = !loggingOn;
 
        if (loggingOn)
-         log_file = create_file(params.output_file);
+         log_file = create_file(params);
        else {
          swap_array(&write_buffer, &read_buffer);
          std::thread t = std::thread(write_file, &log_file);
@@ -933,16 +1255,87 @@ void check_keybinds(struct overlay_params& params){
    }
 }
 
+const char *frame_bound_name(enum frame_bound bound)
+{
+   switch (bound) {
+   case FRAME_BOUND_CPU: return "CPU";
+   case FRAME_BOUND_GPU: return "GPU";
+   case FRAME_BOUND_PRESENT: return "Present";
+   default: return "-";
+   }
+}
+
+/* Shares of the frame time, in percent, above which classify_frame()
+ * blames each side.
+ */
+/* The GPU can't go faster, the rest is gaps between submissions */
+#define BOUND_GPU_BUSY_PCT 90
+/* Blocking this long in acquire/present is pacing, not unfinished work */
+#define BOUND_PRESENT_WAIT_PCT 25
+/* The rest of a busy render thread goes to short waits and syscalls */
+#define BOUND_CPU_BUSY_PCT 80
+
+/* Attributes a frame to what held it back, from the GPU busy time and
+ * where the presenting thread spent the frame time. Frames without GPU
+ * timing are left unknown, a GPU bound application blocking on fences
+ * looks no different from one waiting on anything else.
+ */
+static enum frame_bound classify_frame(const struct swapchain_stats& sw_stats, uint64_t frame_time)
+{
+   if (!frame_time || !sw_stats.gpu_frametime)
+      return FRAME_BOUND_UNKNOWN;
+   if (sw_stats.gpu_frametime * 100 >= frame_time * BOUND_GPU_BUSY_PCT)
+      return FRAME_BOUND_GPU;
+   if (sw_stats.present_wait * 100 >= frame_time * BOUND_PRESENT_WAIT_PCT)
+      return FRAME_BOUND_PRESENT;
+   if (sw_stats.render_cpu * 100 >= frame_time * BOUND_CPU_BUSY_PCT)
+      return FRAME_BOUND_CPU;
+   /* Neither the GPU nor the display, so other application threads */
+   return FRAME_BOUND_CPU;
+}
+
+/* CPU time of the calling thread, ns */
+static uint64_t thread_cpu_time()
+{
+   struct timespec ts;
+   if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts))
+      return 0;
+   return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* CPU time of the presenting thread since the last frame, us */
+static uint64_t render_thread_cpu_time(struct swapchain_stats& sw_stats)
+{
+   uint64_t cpu_time = thread_cpu_time() / 1000;
+   if (!cpu_time)
+      return 0;
+
+   uint64_t elapsed = sw_stats.last_render_cpu && cpu_time > sw_stats.last_render_cpu ?
+      cpu_time - sw_stats.last_render_cpu : 0;
+   sw_stats.last_render_cpu = cpu_time;
+   return elapsed;
+}
+
 void update_hud_info(struct swapchain_stats& sw_stats, struct overlay_params& params, uint32_t vendorID){
-   uint32_t f_idx = sw_stats.n_frames % ARRAY_SIZE(sw_stats.frames_stats);
    uint64_t now = os_time_get(); /* us */
 
    double elapsed = (double)(now - sw_stats.last_fps_update); /* us */
    long int frame_time = now - sw_stats.last_present_time;
    fps = 1000000.0f * sw_stats.n_frames_since_update / elapsed;
-   if (sw_stats.last_present_time) {
-        sw_stats.frames_stats[f_idx].stats[OVERLAY_PLOTS_frame_timing] =
-	  frame_time;
+
+   sw_stats.history.set_length(params.frame_history);
+   float frame_stats[OVERLAY_PLOTS_MAX];
+   frame_stats[OVERLAY_PLOTS_frame_timing] =
+      sw_stats.last_present_time ? frame_time / 1000.0f : 0.0f;
+   frame_stats[OVERLAY_PLOTS_compile_time] = sw_stats.compile_time;
+   sw_stats.history.push(frame_stats);
+
+   /* Only the Vulkan layer sees acquire and present blocking */
+   if (params.bound_by && sw_stats.present_wait_tracked) {
+      sw_stats.render_cpu = render_thread_cpu_time(sw_stats);
+      sw_stats.frame_bound = sw_stats.last_present_time ?
+         classify_frame(sw_stats, frame_time) : FRAME_BOUND_UNKNOWN;
+      sw_stats.n_frames_bound[sw_stats.frame_bound]++;
    }
 
    if (sw_stats.last_fps_update) {
@@ -976,6 +1369,14 @@ void update_hud_info(struct swapchain_stats& sw_stats, struct overlay_params& pa
          cpuLoadLog = sw_stats.total_cpu;
          sw_stats.fps = fps;
 
+         /* The HUD shows what bound most frames of the period */
+         sw_stats.bound = FRAME_BOUND_UNKNOWN;
+         for (unsigned i = FRAME_BOUND_CPU; i < FRAME_BOUND_COUNT; i++) {
+            if (sw_stats.n_frames_bound[i] > sw_stats.n_frames_bound[sw_stats.bound])
+               sw_stats.bound = (enum frame_bound)i;
+         }
+         memset(sw_stats.n_frames_bound, 0, sizeof(sw_stats.n_frames_bound));
+
          if (params.enabled[OVERLAY_PARAM_ENABLED_time]) {
             std::time_t t = std::time(nullptr);
             std::stringstream time;
@@ -1013,6 +1414,29 @@ void update_hud_info(struct swapchain_stats& sw_stats, struct overlay_params& pa
        write_buffer[log_i].cpu = cpuLoadLog;
        write_buffer[log_i].gpu = gpuLoadLog;
        write_buffer[log_i].previous = elapsedLog;
+       write_buffer[log_i].gpu_frametime = sw_stats.gpu_frametime;
+       write_buffer[log_i].present_latency = sw_stats.present_latency;
+       write_buffer[log_i].bound = frame_bound_name(sw_stats.frame_bound);
+       write_buffer[log_i].compile_time = sw_stats.compile_time;
+       write_buffer[log_i].process_vram = sw_stats.process_vram;
+       write_buffer[log_i].heap_pressure = sw_stats.heap_pressure;
+       write_buffer[log_i].allocations_per_sec = sw_stats.allocations_per_sec;
+       write_buffer[log_i].driver_time = sw_stats.driver_time;
+       write_buffer[log_i].n_submits = sw_stats.n_submits;
+       write_buffer[log_i].n_command_buffers = sw_stats.n_command_buffers;
+       write_buffer[log_i].n_draws = sw_stats.n_draws;
+       write_buffer[log_i].n_dispatches = sw_stats.n_dispatches;
+       write_buffer[log_i].n_pipeline_binds = sw_stats.n_pipeline_binds;
+       write_buffer[log_i].gpu_wait_time = sw_stats.gpu_wait_time;
+       write_buffer[log_i].render_thread_wait = sw_stats.render_thread_wait;
+       write_buffer[log_i].frames_ahead_wait = sw_stats.frames_ahead_wait;
+       write_buffer[log_i].display_interval = sw_stats.display_interval;
+       write_buffer[log_i].present_error = sw_stats.present_error;
+       write_buffer[log_i].layer_cpu_time = sw_stats.layer_cpu_time;
+       write_buffer[log_i].layer_gpu_time = sw_stats.layer_gpu_time;
+       write_buffer[log_i].layer_host_memory = sw_stats.layer_host_memory;
+       write_buffer[log_i].layer_device_memory = sw_stats.layer_device_memory;
+       write_buffer[log_i].layer_cmd_reuse = sw_stats.layer_cmd_reuse;
        log_i++;
      }
 
@@ -1045,20 +1469,6 @@ static void snapshot_swapchain_frame(struct swapchain_data *data)
    // }
 }
 
-static float get_time_stat(void *_data, int _idx)
-{
-   struct swapchain_stats *data = (struct swapchain_stats *) _data;
-   if ((ARRAY_SIZE(data->frames_stats) - _idx) > data->n_frames)
-      return 0.0f;
-   int idx = ARRAY_SIZE(data->frames_stats) +
-      data->n_frames < ARRAY_SIZE(data->frames_stats) ?
-      _idx - data->n_frames :
-      _idx + data->n_frames;
-   idx %= ARRAY_SIZE(data->frames_stats);
-   /* Time stats are in us. */
-   return data->frames_stats[idx].stats[data->stat_selector] / data->time_dividor;
-}
-
 void position_layer(struct overlay_params& params, ImVec2 window_size)
 {
    unsigned width = ImGui::GetIO().DisplaySize.x;
@@ -1183,8 +1593,7 @@ void render_mpris_metadata(swapchain_stats& data, metadata& meta, uint64_t frame
 
 void render_imgui(swapchain_stats& data, struct overlay_params& params, ImVec2& window_size, bool is_vulkan)
 {
-   uint32_t f_idx = (data.n_frames - 1) % ARRAY_SIZE(data.frames_stats);
-   uint64_t frame_timing = data.frames_stats[f_idx].stats[OVERLAY_PLOTS_frame_timing];
+   float frame_timing = data.history.last(OVERLAY_PLOTS_frame_timing); /* ms */
    static float char_width = ImGui::CalcTextSize("A").x;
    window_size = ImVec2(params.width, params.height);
    unsigned width = ImGui::GetIO().DisplaySize.x;
@@ -1392,17 +1801,42 @@ void render_imgui(swapchain_stats& data, struct overlay_params& params, ImVec2&
 
          char hash[40];
          snprintf(hash, sizeof(hash), "##%s", overlay_param_names[OVERLAY_PARAM_ENABLED_frame_timing]);
-         data.stat_selector = OVERLAY_PLOTS_frame_timing;
-         data.time_dividor = 1000.0f;
+         /* A long history has more frames than the graph has pixels and
+          * spikes can fall between the plotted points, name the worst.
+          */
+         char overlay_text[32] = "";
+         if (params.frame_history > 200) {
+            snprintf(overlay_text, sizeof(overlay_text), "avg %.1f, max %.1f ms",
+                     data.history.avg(OVERLAY_PLOTS_frame_timing),
+                     data.history.max(OVERLAY_PLOTS_frame_timing));
+         }
 
          ImGui::PushStyleColor(ImGuiCol_FrameBg, ImVec4(0.0f, 0.0f, 0.0f, 0.0f));
          double min_time = 0.0f;
          double max_time = 50.0f;
-         ImGui::PlotLines(hash, get_time_stat, &data,
-                              ARRAY_SIZE(data.frames_stats), 0,
-                              NULL, min_time, max_time,
+         ImGui::PlotLines(hash, data.history.values(OVERLAY_PLOTS_frame_timing),
+                              data.history.capacity(), 0,
+                              overlay_text, min_time, max_time,
                               ImVec2(ImGui::GetContentRegionAvailWidth() - params.font_size * 2.2, 50));
          ImGui::PopStyleColor();
+
+         if (params.compile_stats) {
+            /* Mark the frames that created pipelines */
+            const ImGuiStyle& style = ImGui::GetStyle();
+            ImVec2 min = ImGui::GetItemRectMin();
+            ImVec2 max = ImGui::GetItemRectMax();
+            min = ImVec2(min.x + style.FramePadding.x, min.y + style.FramePadding.y);
+            max = ImVec2(max.x - style.FramePadding.x, max.y - style.FramePadding.y);
+            ImU32 color = ImGui::GetColorU32(ImGuiCol_PlotLinesHovered);
+            const float *compile_times = data.history.values(OVERLAY_PLOTS_compile_time);
+            uint32_t n_frames = data.history.capacity();
+            for (uint32_t i = 0; i < n_frames; i++) {
+               if (compile_times[i] <= 0.0f)
+                  continue;
+               float x = min.x + (max.x - min.x) * i / (n_frames - 1);
+               ImGui::GetWindowDrawList()->AddLine(ImVec2(x, min.y), ImVec2(x, max.y), color);
+            }
+         }
       }
       if (params.enabled[OVERLAY_PARAM_ENABLED_frame_timing]){
          ImGui::SameLine(0,1.0f);
@@ -1410,10 +1844,117 @@ void render_imgui(swapchain_stats& data, struct overlay_params& params, ImVec2&
          ImGui::Text("%.1f ms", 1000 / data.fps); //frame_timing / 1000.f);
          ImGui::PopFont();
       }
+      if (params.gpu_frametime && data.gpu_frametime){
+         /* GPU busy close to the frametime means GPU bound */
+         ImGui::PushFont(data.font1);
+         ImGui::TextColored(ImGui::ColorConvertU32ToFloat4(params.gpu_color), "GPU busy");
+         ImGui::SameLine(0, 4.0f);
+         ImGui::Text("%.1f ms of %.1f ms", data.gpu_frametime / 1000.f, frame_timing);
+         ImGui::PopFont();
+      }
+      if (params.submit_stats && data.n_frames > 1){
+         /* CPU time in the driver's QueueSubmit and QueuePresentKHR */
+         ImGui::PushFont(data.font1);
+         ImGui::TextColored(ImGui::ColorConvertU32ToFloat4(params.cpu_color), "Driver");
+         ImGui::SameLine(0, 4.0f);
+         ImGui::Text("%.2f ms, %" PRIu64 " submits, %" PRIu64 " batches, %" PRIu64 " cmdbufs",
+                     data.driver_time / 1000.f, data.n_submits, data.n_submit_batches,
+                     data.n_command_buffers);
+         ImGui::PopFont();
+      }
+      if (params.wait_stats && data.n_frames > 1){
+         /* Host blocked on fences, semaphores, idle and query waits */
+         ImGui::PushFont(data.font1);
+         ImGui::TextColored(ImGui::ColorConvertU32ToFloat4(params.gpu_color), "GPU waits");
+         ImGui::SameLine(0, 4.0f);
+         ImGui::Text("%.1f ms, render thread %.1f ms, %" PRIu64 " waits",
+                     data.gpu_wait_time / 1000.f, data.render_thread_wait / 1000.f,
+                     data.n_gpu_waits);
+         ImGui::PopFont();
+      }
+      if (data.max_frames_ahead && data.n_frames > 1){
+         /* Time held back by the limiter instead of queuing frames */
+         ImGui::PushFont(data.font1);
+         ImGui::TextColored(ImGui::ColorConvertU32ToFloat4(params.frametime_color), "Render ahead");
+         ImGui::SameLine(0, 4.0f);
+         ImGui::Text("%u, saved %.1f ms", data.max_frames_ahead,
+                     data.frames_ahead_wait / 1000.f);
+         ImGui::PopFont();
+      }
+      if (data.self_overhead && data.n_frames > 1){
+         /* What MangoHud itself costs, as of the previous frame */
+         ImGui::PushFont(data.font1);
+         ImGui::TextColored(ImGui::ColorConvertU32ToFloat4(params.engine_color), "Overlay");
+         ImGui::SameLine(0, 4.0f);
+         ImGui::Text("CPU %.2f ms (layout %.2f), GPU %.2f ms, reused %u%%",
+                     data.layer_cpu_time / 1000.f, data.layer_layout_time / 1000.f,
+                     data.layer_gpu_time / 1000.f, data.layer_cmd_reuse);
+         ImGui::TextColored(ImGui::ColorConvertU32ToFloat4(params.engine_color), "Overlay mem");
+         ImGui::SameLine(0, 4.0f);
+         ImGui::Text("%.1f MiB, VRAM %.1f MiB", data.layer_host_memory / (1024.f * 1024.f),
+                     data.layer_device_memory / (1024.f * 1024.f));
+         ImGui::PopFont();
+      }
+      if (data.display_timing && data.n_frames > 1){
+         /* As shown by the display, a few frames behind */
+         ImGui::PushFont(data.font1);
+         ImGui::TextColored(ImGui::ColorConvertU32ToFloat4(params.frametime_color), "Pacing");
+         ImGui::SameLine(0, 4.0f);
+         ImGui::Text("%.1f ms, %+.2f ms late", data.display_interval / 1000.f,
+                     data.present_error / 1000.f);
+         ImGui::PopFont();
+      }
+      if (params.draw_stats && data.n_frames > 1){
+         ImGui::PushFont(data.font1);
+         ImGui::TextColored(ImGui::ColorConvertU32ToFloat4(params.gpu_color), "Draws");
+         ImGui::SameLine(0, 4.0f);
+         ImGui::Text("%" PRIu64 ", %" PRIu64 " dispatches", data.n_draws, data.n_dispatches);
+         ImGui::TextColored(ImGui::ColorConvertU32ToFloat4(params.gpu_color), "Binds");
+         ImGui::SameLine(0, 4.0f);
+         ImGui::Text("%" PRIu64 " pipelines, %" PRIu64 " descriptor sets",
+                     data.n_pipeline_binds, data.n_descriptor_binds);
+         ImGui::PopFont();
+      }
+      if (params.process_vram && data.last_memory_update){
+         ImGui::PushFont(data.font1);
+         ImGui::TextColored(ImGui::ColorConvertU32ToFloat4(params.vram_color), "Process VRAM");
+         ImGui::SameLine(0, 4.0f);
+         ImGui::Text("%.0f MiB", data.process_vram / (1024.f * 1024.f));
+         if (data.vram_budget) {
+            ImGui::SameLine(0, 4.0f);
+            ImGui::Text("(%.0f%% of budget)", data.heap_pressure * 100.f);
+         }
+         ImGui::TextColored(ImGui::ColorConvertU32ToFloat4(params.vram_color), "Allocations");
+         ImGui::SameLine(0, 4.0f);
+         ImGui::Text("%.0f/s", data.allocations_per_sec);
+         ImGui::PopFont();
+      }
+      if (params.compile_stats && (data.total_compiles || data.total_cache_hits)){
+         ImGui::PushFont(data.font1);
+         ImGui::TextColored(ImGui::ColorConvertU32ToFloat4(params.engine_color), "Pipelines");
+         ImGui::SameLine(0, 4.0f);
+         ImGui::Text("%" PRIu64 " compiled, %" PRIu64 " cached", data.total_compiles,
+                     data.total_cache_hits);
+         ImGui::PopFont();
+      }
+      if (params.bound_by && data.bound != FRAME_BOUND_UNKNOWN){
+         ImGui::PushFont(data.font1);
+         ImGui::TextColored(ImGui::ColorConvertU32ToFloat4(params.engine_color), "Bound by");
+         ImGui::SameLine(0, 4.0f);
+         ImGui::Text("%s", frame_bound_name(data.bound));
+         ImGui::PopFont();
+      }
+      if (params.present_latency && data.present_latency){
+         ImGui::PushFont(data.font1);
+         ImGui::TextColored(ImGui::ColorConvertU32ToFloat4(params.frametime_color), "Present latency");
+         ImGui::SameLine(0, 4.0f);
+         ImGui::Text("%.1f ms", data.present_latency / 1000.f);
+         ImGui::PopFont();
+      }
 
 #ifdef HAVE_DBUS
-      render_mpris_metadata(data, spotify, frame_timing);
-      render_mpris_metadata(data, generic_mpris, frame_timing);
+      render_mpris_metadata(data, spotify, frame_timing * 1000);
+      render_mpris_metadata(data, generic_mpris, frame_timing * 1000);
 #endif
 
       window_size = ImVec2(window_size.x, ImGui::GetCursorPosY() + 10.0f);
@@ -1447,6 +1988,170 @@ void render_imgui(swapchain_stats& data, struct overlay_params& params, ImVec2&
    }
 }
 
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t size)
+{
+   const unsigned char *p = (const unsigned char *)data;
+   uint64_t w;
+
+   for (; size >= sizeof(w); p += sizeof(w), size -= sizeof(w)) {
+      memcpy(&w, p, sizeof(w));
+      h = (h ^ w) * 0x9e3779b97f4a7c15ull;
+      h ^= h >> 29;
+   }
+   w = 0;
+   memcpy(&w, p, size);
+   h = (h ^ w ^ size) * 0x9e3779b97f4a7c15ull;
+   return h ^ (h >> 29);
+}
+
+/* Hash of the geometry in 'draw_data', 'seed' covers whatever else the
+ * caller's rendering depends on.
+ */
+uint64_t hash_draw_data(ImDrawData *draw_data, uint64_t seed)
+{
+   uint64_t h = seed;
+
+   h = hash_bytes(h, &draw_data->DisplayPos, sizeof(draw_data->DisplayPos));
+   h = hash_bytes(h, &draw_data->DisplaySize, sizeof(draw_data->DisplaySize));
+   for (int n = 0; n < draw_data->CmdListsCount; n++) {
+      const ImDrawList* cmd_list = draw_data->CmdLists[n];
+      h = hash_bytes(h, cmd_list->VtxBuffer.Data, cmd_list->VtxBuffer.Size * sizeof(ImDrawVert));
+      h = hash_bytes(h, cmd_list->IdxBuffer.Data, cmd_list->IdxBuffer.Size * sizeof(ImDrawIdx));
+      for (int cmd_i = 0; cmd_i < cmd_list->CmdBuffer.Size; cmd_i++) {
+         const ImDrawCmd* pcmd = &cmd_list->CmdBuffer[cmd_i];
+         h = hash_bytes(h, &pcmd->ClipRect, sizeof(pcmd->ClipRect));
+         h = hash_bytes(h, &pcmd->ElemCount, sizeof(pcmd->ElemCount));
+      }
+   }
+
+   return h ? h : 1;
+}
+
+/* True if the HUD should be laid out again this frame, which is every
+ * frame unless hud_refresh_rate is set.
+ */
+bool hud_refresh_due(const struct overlay_params& params, uint64_t& last_refresh)
+{
+   if (!params.hud_refresh_rate)
+      return true;
+
+   uint64_t now = os_time_get(); /* us */
+   if (now - last_refresh < 1000000 / params.hud_refresh_rate)
+      return false;
+
+   last_refresh = now;
+   return true;
+}
+
+/* Fonts are rasterized once per process for each font_file/font_size and
+ * the atlas is shared by every ImGui context, Vulkan and OpenGL alike.
+ * Atlases are never freed, contexts may come and go for the whole process
+ * lifetime. The backends only keep their own texture copy, and not in
+ * TexID: the OpenGL one owns that.
+ */
+ImFontAtlas *get_shared_font_atlas(const struct overlay_params& params,
+                                   ImFont **font, ImFont **font_small)
+{
+   struct shared_font_atlas {
+      ImFontAtlas atlas;
+      ImFont *font, *font_small;
+   };
+   static std::mutex lock;
+   static std::map<std::pair<std::string, int>, struct shared_font_atlas *> atlases;
+
+   int font_size = params.font_size;
+   if (!font_size)
+      font_size = 24;
+
+   std::string font_file;
+   if (!params.font_file.empty() && file_exists(params.font_file))
+      font_file = params.font_file;
+
+   scoped_lock lk(lock);
+   struct shared_font_atlas *&shared = atlases[std::make_pair(font_file, font_size)];
+   if (!shared) {
+      shared = new shared_font_atlas();
+      ImFontAtlas *atlas = &shared->atlas;
+
+      if (!font_file.empty()) {
+         shared->font = atlas->AddFontFromFileTTF(font_file.c_str(), font_size);
+         shared->font_small = atlas->AddFontFromFileTTF(font_file.c_str(), font_size * 0.55f);
+      } else {
+         ImFontConfig font_cfg = ImFontConfig();
+         const char* ttf_compressed_base85 = GetDefaultCompressedFontDataTTFBase85();
+         const ImWchar* glyph_ranges = atlas->GetGlyphRangesDefault();
+
+         shared->font = atlas->AddFontFromMemoryCompressedBase85TTF(ttf_compressed_base85, font_size, &font_cfg, glyph_ranges);
+         shared->font_small = atlas->AddFontFromMemoryCompressedBase85TTF(ttf_compressed_base85, font_size * 0.55, &font_cfg, glyph_ranges);
+      }
+
+      /* Build and convert now, contexts only read the atlas afterwards */
+      unsigned char* pixels;
+      int width, height;
+      atlas->GetTexDataAsRGBA32(&pixels, &width, &height);
+   }
+
+   *font = shared->font;
+   *font_small = shared->font_small;
+   return &shared->atlas;
+}
+
+/* Sets 'quad' up to draw 'texture', holding 'hud' rendered at display size,
+ * over the bounding box of the HUD geometry.
+ */
+void update_hud_quad(struct hud_quad& quad, ImDrawData *hud, ImTextureID texture, bool flip_y)
+{
+   ImVec2 size = hud->DisplaySize;
+   ImVec2 min = size, max(0.0f, 0.0f);
+
+   for (int n = 0; n < hud->CmdListsCount; n++) {
+      const ImDrawList* cmd_list = hud->CmdLists[n];
+      for (int i = 0; i < cmd_list->VtxBuffer.Size; i++) {
+         const ImVec2& pos = cmd_list->VtxBuffer[i].pos;
+         min = ImVec2(std::min(min.x, pos.x), std::min(min.y, pos.y));
+         max = ImVec2(std::max(max.x, pos.x), std::max(max.y, pos.y));
+      }
+   }
+
+   /* Whole pixels so the quad samples texel centers */
+   min = ImVec2(std::max(floorf(min.x), 0.0f), std::max(floorf(min.y), 0.0f));
+   max = ImVec2(std::min(ceilf(max.x), size.x), std::min(ceilf(max.y), size.y));
+   if (min.x >= max.x || min.y >= max.y)
+      min = max = ImVec2(0.0f, 0.0f);
+
+   ImVec2 uv0(min.x / size.x, min.y / size.y);
+   ImVec2 uv1(max.x / size.x, max.y / size.y);
+   if (flip_y) {
+      uv0.y = 1.0f - uv0.y;
+      uv1.y = 1.0f - uv1.y;
+   }
+
+   quad.list.VtxBuffer.resize(4);
+   quad.list.VtxBuffer[0] = { ImVec2(min.x, min.y), ImVec2(uv0.x, uv0.y), IM_COL32_WHITE };
+   quad.list.VtxBuffer[1] = { ImVec2(max.x, min.y), ImVec2(uv1.x, uv0.y), IM_COL32_WHITE };
+   quad.list.VtxBuffer[2] = { ImVec2(max.x, max.y), ImVec2(uv1.x, uv1.y), IM_COL32_WHITE };
+   quad.list.VtxBuffer[3] = { ImVec2(min.x, max.y), ImVec2(uv0.x, uv1.y), IM_COL32_WHITE };
+
+   static const ImDrawIdx indices[6] = { 0, 1, 2, 0, 2, 3 };
+   quad.list.IdxBuffer.resize(6);
+   memcpy(quad.list.IdxBuffer.Data, indices, sizeof(indices));
+
+   quad.list.CmdBuffer.resize(1);
+   quad.list.CmdBuffer[0] = ImDrawCmd();
+   quad.list.CmdBuffer[0].ElemCount = 6;
+   quad.list.CmdBuffer[0].ClipRect = ImVec4(min.x, min.y, max.x, max.y);
+   quad.list.CmdBuffer[0].TextureId = texture;
+
+   quad.draw_data.Valid = true;
+   quad.draw_data.CmdLists = quad.lists;
+   quad.draw_data.CmdListsCount = 1;
+   quad.draw_data.TotalVtxCount = 4;
+   quad.draw_data.TotalIdxCount = 6;
+   quad.draw_data.DisplayPos = hud->DisplayPos;
+   quad.draw_data.DisplaySize = hud->DisplaySize;
+   quad.draw_data.FramebufferScale = hud->FramebufferScale;
+}
+
 static void compute_swapchain_display(struct swapchain_data *data)
 {
    struct device_data *device_data = data->device;
@@ -1469,86 +2174,343 @@ static uint32_t vk_memory_type(struct device_data *data,
                                VkMemoryPropertyFlags properties,
                                uint32_t type_bits)
 {
-    VkPhysicalDeviceMemoryProperties prop;
-    data->instance->vtable.GetPhysicalDeviceMemoryProperties(data->physical_device, &prop);
+    const VkPhysicalDeviceMemoryProperties& prop = data->memory_properties;
     for (uint32_t i = 0; i < prop.memoryTypeCount; i++)
         if ((prop.memoryTypes[i].propertyFlags & properties) == properties && type_bits & (1<<i))
             return i;
     return 0xFFFFFFFF; // Unable to find memoryType
 }
 
-static void ensure_swapchain_fonts(struct swapchain_data *data,
-                                   VkCommandBuffer command_buffer)
+#define DEVICE_MEMORY_BLOCK_SIZE (1024 * 1024)
+
+#ifndef NDEBUG
+static void print_device_memory(struct device_data *data)
 {
-   if (data->font_uploaded)
-      return;
+   std::cerr << "MANGOHUD: layer device memory: "
+             << data->memory_allocated / 1024 << " KiB in "
+             << data->memory_blocks.size() << " block(s)\n";
+}
+#endif
 
-   data->font_uploaded = true;
+static bool alloc_from_block(struct device_memory_block *block,
+                             VkDeviceSize size, VkDeviceSize alignment,
+                             VkDeviceSize *offset)
+{
+   for (auto it = block->free_ranges.begin(); it != block->free_ranges.end(); ++it) {
+      VkDeviceSize start = ALIGN_POT(it->first, alignment);
+      VkDeviceSize end = it->first + it->second;
+      if (start + size > end)
+         continue;
 
-   struct device_data *device_data = data->device;
-   ImGuiIO& io = ImGui::GetIO();
-   unsigned char* pixels;
-   int width, height;
-   io.Fonts->GetTexDataAsRGBA32(&pixels, &width, &height);
-   size_t upload_size = width * height * 4 * sizeof(char);
+      VkDeviceSize range_start = it->first;
+      block->free_ranges.erase(it);
+      if (start > range_start)
+         block->free_ranges[range_start] = start - range_start;
+      if (start + size < end)
+         block->free_ranges[start + size] = end - (start + size);
+      *offset = start;
+      return true;
+   }
+   return false;
+}
 
-   /* Upload buffer */
-   VkBufferCreateInfo buffer_info = {};
-   buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-   buffer_info.size = upload_size;
-   buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
-   buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-   VK_CHECK(device_data->vtable.CreateBuffer(device_data->device, &buffer_info,
-                                             NULL, &data->upload_font_buffer));
-   VkMemoryRequirements upload_buffer_req;
-   device_data->vtable.GetBufferMemoryRequirements(device_data->device,
-                                                   data->upload_font_buffer,
-                                                   &upload_buffer_req);
-   VkMemoryAllocateInfo upload_alloc_info = {};
-   upload_alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-   upload_alloc_info.allocationSize = upload_buffer_req.size;
-   upload_alloc_info.memoryTypeIndex = vk_memory_type(device_data,
-                                                      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
-                                                      upload_buffer_req.memoryTypeBits);
-   VK_CHECK(device_data->vtable.AllocateMemory(device_data->device,
-                                               &upload_alloc_info,
-                                               NULL,
-                                               &data->upload_font_buffer_mem));
-   VK_CHECK(device_data->vtable.BindBufferMemory(device_data->device,
-                                                 data->upload_font_buffer,
-                                                 data->upload_font_buffer_mem, 0));
-
-   /* Upload to Buffer */
-   char* map = NULL;
-   VK_CHECK(device_data->vtable.MapMemory(device_data->device,
-                                          data->upload_font_buffer_mem,
-                                          0, upload_size, 0, (void**)(&map)));
-   memcpy(map, pixels, upload_size);
-   VkMappedMemoryRange range[1] = {};
-   range[0].sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
-   range[0].memory = data->upload_font_buffer_mem;
-   range[0].size = upload_size;
-   VK_CHECK(device_data->vtable.FlushMappedMemoryRanges(device_data->device, 1, range));
-   device_data->vtable.UnmapMemory(device_data->device,
-                                   data->upload_font_buffer_mem);
+/* Sub-allocates memory for a layer resource. 'properties' must be
+ * supported by one of the types in req.memoryTypeBits.
+ */
+static bool alloc_device_memory(struct device_data *data,
+                                const VkMemoryRequirements& req,
+                                VkMemoryPropertyFlags properties,
+                                struct device_allocation *alloc)
+{
+   uint32_t type_index = vk_memory_type(data, properties, req.memoryTypeBits);
+   if (type_index == 0xFFFFFFFF)
+      return false;
+
+   /* Buffers and optimal images may end up in the same block */
+   VkDeviceSize granularity = data->properties.limits.bufferImageGranularity;
+   VkDeviceSize alignment = std::max(req.alignment, granularity);
+   VkDeviceSize size = ALIGN_POT(req.size, granularity);
+
+   scoped_lock lk(data->memory_lock);
+
+   *alloc = {};
+   for (auto block : data->memory_blocks) {
+      if (block->type_index == type_index &&
+          alloc_from_block(block, size, alignment, &alloc->offset)) {
+         alloc->block = block;
+         break;
+      }
+   }
 
-   /* Copy buffer to image */
-   VkImageMemoryBarrier copy_barrier[1] = {};
-   copy_barrier[0].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-   copy_barrier[0].dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-   copy_barrier[0].oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-   copy_barrier[0].newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-   copy_barrier[0].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-   copy_barrier[0].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-   copy_barrier[0].image = data->font_image;
-   copy_barrier[0].subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-   copy_barrier[0].subresourceRange.levelCount = 1;
-   copy_barrier[0].subresourceRange.layerCount = 1;
-   device_data->vtable.CmdPipelineBarrier(command_buffer,
-                                          VK_PIPELINE_STAGE_HOST_BIT,
-                                          VK_PIPELINE_STAGE_TRANSFER_BIT,
-                                          0, 0, NULL, 0, NULL,
-                                          1, copy_barrier);
+   if (!alloc->block) {
+      struct device_memory_block *block = new device_memory_block();
+      block->size = std::max<VkDeviceSize>(ALIGN_POT(size, granularity), DEVICE_MEMORY_BLOCK_SIZE);
+      block->type_index = type_index;
+
+      VkMemoryAllocateInfo alloc_info = {};
+      alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+      alloc_info.allocationSize = block->size;
+      alloc_info.memoryTypeIndex = type_index;
+      VkResult result = data->vtable.AllocateMemory(data->device, &alloc_info,
+                                                    NULL, &block->memory);
+      if (result != VK_SUCCESS) {
+         fprintf(stderr, "MANGOHUD: failed to allocate %" PRIu64 " bytes of device memory: %s\n",
+                 (uint64_t)block->size, vk_Result_to_str(result));
+         delete block;
+         return false;
+      }
+
+      if (data->memory_properties.memoryTypes[type_index].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+         VK_CHECK(data->vtable.MapMemory(data->device, block->memory, 0,
+                                         VK_WHOLE_SIZE, 0, (void**)&block->map));
+
+      block->free_ranges[0] = block->size;
+      data->memory_blocks.push_back(block);
+      data->memory_allocated += block->size;
+#ifndef NDEBUG
+      print_device_memory(data);
+#endif
+
+      alloc_from_block(block, size, alignment, &alloc->offset);
+      alloc->block = block;
+   }
+
+   alloc->size = size;
+   if (alloc->block->map)
+      alloc->map = alloc->block->map + alloc->offset;
+   return true;
+}
+
+static void free_device_block(struct device_data *data,
+                              struct device_memory_block *block)
+{
+   if (block->map)
+      data->vtable.UnmapMemory(data->device, block->memory);
+   data->vtable.FreeMemory(data->device, block->memory, NULL);
+   data->memory_allocated -= block->size;
+   delete block;
+}
+
+static void free_device_memory(struct device_data *data,
+                               struct device_allocation *alloc)
+{
+   struct device_memory_block *block = alloc->block;
+   if (!block)
+      return;
+
+   scoped_lock lk(data->memory_lock);
+
+   /* Give the range back, merging it with its free neighbours */
+   VkDeviceSize offset = alloc->offset;
+   VkDeviceSize size = alloc->size;
+   auto next = block->free_ranges.lower_bound(offset);
+   if (next != block->free_ranges.end() && offset + size == next->first) {
+      size += next->second;
+      next = block->free_ranges.erase(next);
+   }
+   if (next != block->free_ranges.begin()) {
+      auto prev = std::prev(next);
+      if (prev->first + prev->second == offset) {
+         offset = prev->first;
+         size += prev->second;
+         block->free_ranges.erase(prev);
+      }
+   }
+   block->free_ranges[offset] = size;
+   *alloc = {};
+
+   if (size == block->size) {
+      data->memory_blocks.erase(std::find(data->memory_blocks.begin(),
+                                          data->memory_blocks.end(), block));
+      free_device_block(data, block);
+#ifndef NDEBUG
+      print_device_memory(data);
+#endif
+   }
+}
+
+/* The driver validates the cache header itself, the file name only keeps
+ * different GPUs and driver versions from overwriting each other's cache.
+ */
+static std::string pipeline_cache_path(struct device_data *data)
+{
+   std::string path = get_cache_dir();
+   if (path.empty())
+      return path;
+
+   char name[128];
+   int len = snprintf(name, sizeof(name), "/MangoHud/pipeline_cache_%04x_%04x_%08x_",
+                      data->properties.vendorID, data->properties.deviceID,
+                      data->properties.driverVersion);
+   for (unsigned i = 0; i < VK_UUID_SIZE; i++)
+      len += snprintf(name + len, sizeof(name) - len, "%02x",
+                      data->properties.pipelineCacheUUID[i]);
+   return path + name;
+}
+
+static void load_pipeline_cache(struct device_data *data)
+{
+   std::vector<char> cache_data;
+
+   data->pipeline_cache_path = pipeline_cache_path(data);
+   if (!data->pipeline_cache_path.empty()) {
+      FILE *f = fopen(data->pipeline_cache_path.c_str(), "rb");
+      if (f) {
+         fseek(f, 0, SEEK_END);
+         long size = ftell(f);
+         fseek(f, 0, SEEK_SET);
+         if (size > 0) {
+            cache_data.resize(size);
+            if (fread(cache_data.data(), 1, size, f) != (size_t)size)
+               cache_data.clear();
+         }
+         fclose(f);
+      }
+   }
+
+   VkPipelineCacheCreateInfo cache_info = {};
+   cache_info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+   cache_info.initialDataSize = cache_data.size();
+   cache_info.pInitialData = cache_data.data();
+   if (data->vtable.CreatePipelineCache(data->device, &cache_info,
+                                        NULL, &data->pipeline_cache) != VK_SUCCESS) {
+      /* Stale or corrupt data, start over */
+      cache_info.initialDataSize = 0;
+      cache_info.pInitialData = NULL;
+      VK_CHECK(data->vtable.CreatePipelineCache(data->device, &cache_info,
+                                                NULL, &data->pipeline_cache));
+      cache_data.clear();
+   }
+   data->pipeline_cache_size = cache_data.size();
+}
+
+/* Writes the cache back if pipelines were added to it. Goes through a
+ * temporary file so a concurrent reader never sees a partial cache.
+ */
+static void save_pipeline_cache(struct device_data *data)
+{
+   if (data->pipeline_cache == VK_NULL_HANDLE || data->pipeline_cache_path.empty())
+      return;
+
+   std::lock_guard<std::mutex> lk(data->pipeline_cache_lock);
+
+   size_t size = 0;
+   if (data->vtable.GetPipelineCacheData(data->device, data->pipeline_cache,
+                                         &size, NULL) != VK_SUCCESS ||
+       size == data->pipeline_cache_size)
+      return;
+
+   std::vector<char> cache_data(size);
+   if (data->vtable.GetPipelineCacheData(data->device, data->pipeline_cache,
+                                         &size, cache_data.data()) != VK_SUCCESS)
+      return;
+
+   std::string dir = data->pipeline_cache_path.substr(0, data->pipeline_cache_path.rfind('/'));
+   if (!make_dirs(dir))
+      return;
+
+   std::string tmp_path = data->pipeline_cache_path + "." + std::to_string(getpid());
+   FILE *f = fopen(tmp_path.c_str(), "wb");
+   if (!f)
+      return;
+   bool written = fwrite(cache_data.data(), 1, size, f) == size;
+   if (fclose(f) == 0 && written &&
+       rename(tmp_path.c_str(), data->pipeline_cache_path.c_str()) == 0) {
+      data->pipeline_cache_size = size;
+   } else {
+      unlink(tmp_path.c_str());
+   }
+}
+
+/* The first swapchain to draw uploads the device's copy, in a submission
+ * of its own that it waits for. Swapchains presented from other threads
+ * don't order their draws after that swapchain's, so the font must be
+ * ready before any of them sees it uploaded. Returns false if the fonts
+ * can't be drawn with yet.
+ */
+static bool ensure_swapchain_fonts(struct swapchain_data *data)
+{
+   if (data->font_uploaded)
+      return true;
+   if (!data->device_font)
+      return false;
+
+   struct device_data *device_data = data->device;
+   struct device_font *font = data->device_font;
+   scoped_lock lk(device_data->font_lock);
+   if (font->uploaded) {
+      data->font_uploaded = true;
+      return true;
+   }
+
+   unsigned char* pixels;
+   int width, height;
+   font->atlas->GetTexDataAsRGBA32(&pixels, &width, &height);
+   size_t upload_size = width * height * 4 * sizeof(char);
+
+   /* Upload buffer */
+   VkBuffer upload_buffer;
+   struct device_allocation upload_mem;
+   VkBufferCreateInfo buffer_info = {};
+   buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+   buffer_info.size = upload_size;
+   buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+   buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+   VK_CHECK(device_data->vtable.CreateBuffer(device_data->device, &buffer_info,
+                                             NULL, &upload_buffer));
+   VkMemoryRequirements upload_buffer_req;
+   device_data->vtable.GetBufferMemoryRequirements(device_data->device,
+                                                   upload_buffer,
+                                                   &upload_buffer_req);
+   if (!alloc_device_memory(device_data, upload_buffer_req,
+                            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                            &upload_mem)) {
+      /* Tried again next frame */
+      device_data->vtable.DestroyBuffer(device_data->device, upload_buffer, NULL);
+      return false;
+   }
+   VK_CHECK(device_data->vtable.BindBufferMemory(device_data->device,
+                                                 upload_buffer,
+                                                 upload_mem.block->memory,
+                                                 upload_mem.offset));
+
+   /* Upload to Buffer, staging memory is host coherent */
+   memcpy(upload_mem.map, pixels, upload_size);
+
+   VkCommandBuffer command_buffer;
+   VkCommandBufferAllocateInfo cmd_buffer_info = {};
+   cmd_buffer_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+   cmd_buffer_info.commandPool = data->command_pool;
+   cmd_buffer_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+   cmd_buffer_info.commandBufferCount = 1;
+   VK_CHECK(device_data->vtable.AllocateCommandBuffers(device_data->device,
+                                                       &cmd_buffer_info,
+                                                       &command_buffer));
+   VK_CHECK(device_data->set_device_loader_data(device_data->device,
+                                                command_buffer));
+
+   VkCommandBufferBeginInfo begin_info = {};
+   begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+   begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+   device_data->vtable.BeginCommandBuffer(command_buffer, &begin_info);
+
+   /* Copy buffer to image */
+   VkImageMemoryBarrier copy_barrier[1] = {};
+   copy_barrier[0].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+   copy_barrier[0].dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+   copy_barrier[0].oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+   copy_barrier[0].newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+   copy_barrier[0].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+   copy_barrier[0].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+   copy_barrier[0].image = font->image;
+   copy_barrier[0].subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+   copy_barrier[0].subresourceRange.levelCount = 1;
+   copy_barrier[0].subresourceRange.layerCount = 1;
+   device_data->vtable.CmdPipelineBarrier(command_buffer,
+                                          VK_PIPELINE_STAGE_HOST_BIT,
+                                          VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                          0, 0, NULL, 0, NULL,
+                                          1, copy_barrier);
 
    VkBufferImageCopy region = {};
    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
@@ -1557,11 +2519,12 @@ static void ensure_swapchain_fonts(struct swapchain_data *data,
    region.imageExtent.height = height;
    region.imageExtent.depth = 1;
    device_data->vtable.CmdCopyBufferToImage(command_buffer,
-                                            data->upload_font_buffer,
-                                            data->font_image,
+                                            upload_buffer,
+                                            font->image,
                                             VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
                                             1, &region);
 
+   /* The fence wait makes the copy visible, only the layout changes here */
    VkImageMemoryBarrier use_barrier[1] = {};
    use_barrier[0].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
    use_barrier[0].srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
@@ -1570,136 +2533,159 @@ static void ensure_swapchain_fonts(struct swapchain_data *data,
    use_barrier[0].newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
    use_barrier[0].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
    use_barrier[0].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-   use_barrier[0].image = data->font_image;
+   use_barrier[0].image = font->image;
    use_barrier[0].subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
    use_barrier[0].subresourceRange.levelCount = 1;
    use_barrier[0].subresourceRange.layerCount = 1;
    device_data->vtable.CmdPipelineBarrier(command_buffer,
                                           VK_PIPELINE_STAGE_TRANSFER_BIT,
-                                          VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                                          VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
                                           0,
                                           0, NULL,
                                           0, NULL,
                                           1, use_barrier);
+   device_data->vtable.EndCommandBuffer(command_buffer);
 
-   /* Store our identifier */
-   io.Fonts->TexID = (ImTextureID)(intptr_t)data->font_image;
+   /* Once per device and font, the staging is released right after */
+   VkFence fence;
+   VkFenceCreateInfo fence_info = {};
+   fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+   VK_CHECK(device_data->vtable.CreateFence(device_data->device, &fence_info,
+                                            NULL, &fence));
+   VkSubmitInfo submit_info = {};
+   submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+   submit_info.commandBufferCount = 1;
+   submit_info.pCommandBuffers = &command_buffer;
+   VK_CHECK(device_data->vtable.QueueSubmit(device_data->graphic_queue->queue, 1,
+                                            &submit_info, fence));
+   VK_CHECK(device_data->vtable.WaitForFences(device_data->device, 1, &fence,
+                                              VK_TRUE, UINT64_MAX));
+
+   device_data->vtable.DestroyFence(device_data->device, fence, NULL);
+   device_data->vtable.FreeCommandBuffers(device_data->device, data->command_pool,
+                                          1, &command_buffer);
+   device_data->vtable.DestroyBuffer(device_data->device, upload_buffer, NULL);
+   free_device_memory(device_data, &upload_mem);
+
+   font->uploaded = true;
+   data->font_uploaded = true;
+   return true;
 }
 
-static void CreateOrResizeBuffer(struct device_data *data,
-                                 VkBuffer *buffer,
-                                 VkDeviceMemory *buffer_memory,
-                                 VkDeviceSize *buffer_size,
-                                 size_t new_size, VkBufferUsageFlagBits usage)
+/* Releases what every draw the GPU is done with was holding */
+static void retire_overlay_draws(struct swapchain_data *data)
 {
-    if (*buffer != VK_NULL_HANDLE)
-        data->vtable.DestroyBuffer(data->device, *buffer, NULL);
-    if (*buffer_memory)
-        data->vtable.FreeMemory(data->device, *buffer_memory, NULL);
+   update_completed_serial(data);
+   for (auto& draw : data->draws) {
+      if (draw.serial && draw.serial <= data->completed_serial)
+         overlay_draw_complete(data, &draw);
+   }
+}
 
-    VkBufferCreateInfo buffer_info = {};
-    buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    buffer_info.size = new_size;
-    buffer_info.usage = usage;
-    buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-    VK_CHECK(data->vtable.CreateBuffer(data->device, &buffer_info, NULL, buffer));
+static void destroy_overlay_ring(struct swapchain_data *data)
+{
+   struct device_data *device_data = data->device;
 
-    VkMemoryRequirements req;
-    data->vtable.GetBufferMemoryRequirements(data->device, *buffer, &req);
-    VkMemoryAllocateInfo alloc_info = {};
-    alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    alloc_info.allocationSize = req.size;
-    alloc_info.memoryTypeIndex =
-       vk_memory_type(data, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, req.memoryTypeBits);
-    VK_CHECK(data->vtable.AllocateMemory(data->device, &alloc_info, NULL, buffer_memory));
+   if (data->ring.buffer == VK_NULL_HANDLE)
+      return;
 
-    VK_CHECK(data->vtable.BindBufferMemory(data->device, *buffer, *buffer_memory, 0));
-    *buffer_size = new_size;
+   device_data->vtable.DestroyBuffer(device_data->device, data->ring.buffer, NULL);
+   free_device_memory(device_data, &data->ring.mem);
+   data->ring = {};
 }
 
-static struct overlay_draw *render_swapchain_display(struct swapchain_data *data,
-                                                     struct queue_data *present_queue,
-                                                     const VkSemaphore *wait_semaphores,
-                                                     unsigned n_wait_semaphores,
-                                                     unsigned image_index)
+/* (Re)creates the ring so that it fits 'size' bytes for every frame in
+ * flight. Only happens on the first frame and when the HUD outgrows the
+ * ring, the draws still using the old buffer are waited on first.
+ * Returns false if the new one couldn't be allocated, leaving no ring.
+ */
+static bool resize_overlay_ring(struct swapchain_data *data,
+                                struct overlay_draw *current_draw,
+                                VkDeviceSize size)
 {
-   ImDrawData* draw_data = ImGui::GetDrawData();
-   if (draw_data->TotalVtxCount == 0)
-      return NULL;
-
    struct device_data *device_data = data->device;
-   struct overlay_draw *draw = get_overlay_draw(data);
 
-   device_data->vtable.ResetCommandBuffer(draw->command_buffer, 0);
+   if (data->ring.buffer != VK_NULL_HANDLE)
+      wait_overlay_draws(data, current_draw->serial - 1);
 
-   VkRenderPassBeginInfo render_pass_info = {};
-   render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-   render_pass_info.renderPass = data->render_pass;
-   render_pass_info.framebuffer = data->framebuffers[image_index];
-   render_pass_info.renderArea.extent.width = data->width;
-   render_pass_info.renderArea.extent.height = data->height;
+   VkDeviceSize new_size = std::max<VkDeviceSize>(size * (data->images.size() + 1), 64 * 1024);
+   new_size = std::max(new_size, data->ring.size * 2);
+   destroy_overlay_ring(data);
 
-   VkCommandBufferBeginInfo buffer_begin_info = {};
-   buffer_begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+   /* Positions restart from 0 in the new ring */
+   for (auto& draw : data->draws)
+      draw.ring_end = 0;
+
+   VkBufferCreateInfo buffer_info = {};
+   buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+   buffer_info.size = new_size;
+   buffer_info.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT;
+   buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+   VK_CHECK(device_data->vtable.CreateBuffer(device_data->device, &buffer_info,
+                                             NULL, &data->ring.buffer));
 
-   device_data->vtable.BeginCommandBuffer(draw->command_buffer, &buffer_begin_info);
+   VkMemoryRequirements req;
+   device_data->vtable.GetBufferMemoryRequirements(device_data->device,
+                                                   data->ring.buffer, &req);
+   if (!alloc_device_memory(device_data, req,
+                            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                            &data->ring.mem)) {
+      destroy_overlay_ring(data);
+      return false;
+   }
+   VK_CHECK(device_data->vtable.BindBufferMemory(device_data->device, data->ring.buffer,
+                                                 data->ring.mem.block->memory,
+                                                 data->ring.mem.offset));
+   data->ring.map = data->ring.mem.map;
+   data->ring.size = new_size;
+   return true;
+}
 
-   ensure_swapchain_fonts(data, draw->command_buffer);
+static bool try_alloc_overlay_ring(struct swapchain_data *data,
+                                   VkDeviceSize size, VkDeviceSize *offset)
+{
+   if (size > data->ring.size)
+      return false;
+
+   uint64_t head = data->ring.head;
+   VkDeviceSize off = head % data->ring.size;
+   /* Don't split an allocation across the end of the buffer */
+   if (off + size > data->ring.size) {
+      head += data->ring.size - off;
+      off = 0;
+   }
+   if (head + size - data->ring.tail > data->ring.size)
+      return false;
 
-   /* Bounce the image to display back to color attachment layout for
-    * rendering on top of it.
-    */
-   VkImageMemoryBarrier imb;
-   imb.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-   imb.pNext = nullptr;
-   imb.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
-   imb.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
-   imb.oldLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-   imb.newLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-   imb.image = data->images[image_index];
-   imb.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-   imb.subresourceRange.baseMipLevel = 0;
-   imb.subresourceRange.levelCount = 1;
-   imb.subresourceRange.baseArrayLayer = 0;
-   imb.subresourceRange.layerCount = 1;
-   imb.srcQueueFamilyIndex = present_queue->family_index;
-   imb.dstQueueFamilyIndex = device_data->graphic_queue->family_index;
-   device_data->vtable.CmdPipelineBarrier(draw->command_buffer,
-                                          VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT,
-                                          VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT,
-                                          0,          /* dependency flags */
-                                          0, nullptr, /* memory barriers */
-                                          0, nullptr, /* buffer memory barriers */
-                                          1, &imb);   /* image memory barriers */
+   data->ring.head = head + size;
+   *offset = off;
+   return true;
+}
 
-   device_data->vtable.CmdBeginRenderPass(draw->command_buffer, &render_pass_info,
-                                          VK_SUBPASS_CONTENTS_INLINE);
+/* Sets 'offset' to the ring offset of 'size' bytes for the draw being
+ * recorded, returns false if the ring couldn't grow to fit them. 'size'
+ * must be a multiple of 16 to keep every offset aligned.
+ */
+static bool alloc_overlay_ring(struct swapchain_data *data,
+                               struct overlay_draw *draw,
+                               VkDeviceSize size, VkDeviceSize *offset)
+{
+   if (!try_alloc_overlay_ring(data, size, offset)) {
+      retire_overlay_draws(data);
+      if (!try_alloc_overlay_ring(data, size, offset) &&
+          (!resize_overlay_ring(data, draw, size) ||
+           !try_alloc_overlay_ring(data, size, offset)))
+         return false;
+   }
+
+   draw->ring_end = data->ring.head;
+   return true;
+}
 
-   /* Create/Resize vertex & index buffers */
-   size_t vertex_size = draw_data->TotalVtxCount * sizeof(ImDrawVert);
-   size_t index_size = draw_data->TotalIdxCount * sizeof(ImDrawIdx);
-   if (draw->vertex_buffer_size < vertex_size) {
-      CreateOrResizeBuffer(device_data,
-                           &draw->vertex_buffer,
-                           &draw->vertex_buffer_mem,
-                           &draw->vertex_buffer_size,
-                           vertex_size, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
-   }
-   if (draw->index_buffer_size < index_size) {
-      CreateOrResizeBuffer(device_data,
-                           &draw->index_buffer,
-                           &draw->index_buffer_mem,
-                           &draw->index_buffer_size,
-                           index_size, VK_BUFFER_USAGE_INDEX_BUFFER_BIT);
-   }
-
-    /* Upload vertex & index data */
-    ImDrawVert* vtx_dst = NULL;
-    ImDrawIdx* idx_dst = NULL;
-    VK_CHECK(device_data->vtable.MapMemory(device_data->device, draw->vertex_buffer_mem,
-                                           0, vertex_size, 0, (void**)(&vtx_dst)));
-    VK_CHECK(device_data->vtable.MapMemory(device_data->device, draw->index_buffer_mem,
-                                           0, index_size, 0, (void**)(&idx_dst)));
+static void copy_draw_data(ImDrawData *draw_data, char *vertex_map, char *index_map)
+{
+    ImDrawVert* vtx_dst = (ImDrawVert*)vertex_map;
+    ImDrawIdx* idx_dst = (ImDrawIdx*)index_map;
     for (int n = 0; n < draw_data->CmdListsCount; n++)
         {
            const ImDrawList* cmd_list = draw_data->CmdLists[n];
@@ -1708,28 +2694,31 @@ static struct overlay_draw *render_swapchain_display(struct swapchain_data *data
            vtx_dst += cmd_list->VtxBuffer.Size;
            idx_dst += cmd_list->IdxBuffer.Size;
         }
-    VkMappedMemoryRange range[2] = {};
-    range[0].sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
-    range[0].memory = draw->vertex_buffer_mem;
-    range[0].size = VK_WHOLE_SIZE;
-    range[1].sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
-    range[1].memory = draw->index_buffer_mem;
-    range[1].size = VK_WHOLE_SIZE;
-    VK_CHECK(device_data->vtable.FlushMappedMemoryRanges(device_data->device, 2, range));
-    device_data->vtable.UnmapMemory(device_data->device, draw->vertex_buffer_mem);
-    device_data->vtable.UnmapMemory(device_data->device, draw->index_buffer_mem);
+}
+
+/* Records the draws of 'draw_data' into the current render pass */
+static void draw_overlay_data(struct swapchain_data *data,
+                              VkCommandBuffer command_buffer,
+                              ImDrawData *draw_data,
+                              VkPipeline pipeline,
+                              VkDescriptorSet descriptor_set,
+                              VkBuffer buffer,
+                              VkDeviceSize vertex_offset,
+                              VkDeviceSize index_offset)
+{
+   struct device_data *device_data = data->device;
 
     /* Bind pipeline and descriptor sets */
-    device_data->vtable.CmdBindPipeline(draw->command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, data->pipeline);
-    VkDescriptorSet desc_set[1] = { data->descriptor_set };
-    device_data->vtable.CmdBindDescriptorSets(draw->command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+    device_data->vtable.CmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+    VkDescriptorSet desc_set[1] = { descriptor_set };
+    device_data->vtable.CmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
                                               data->pipeline_layout, 0, 1, desc_set, 0, NULL);
 
     /* Bind vertex & index buffers */
-    VkBuffer vertex_buffers[1] = { draw->vertex_buffer };
-    VkDeviceSize vertex_offset[1] = { 0 };
-    device_data->vtable.CmdBindVertexBuffers(draw->command_buffer, 0, 1, vertex_buffers, vertex_offset);
-    device_data->vtable.CmdBindIndexBuffer(draw->command_buffer, draw->index_buffer, 0, VK_INDEX_TYPE_UINT16);
+    VkBuffer vertex_buffers[1] = { buffer };
+    VkDeviceSize vertex_offsets[1] = { vertex_offset };
+    device_data->vtable.CmdBindVertexBuffers(command_buffer, 0, 1, vertex_buffers, vertex_offsets);
+    device_data->vtable.CmdBindIndexBuffer(command_buffer, buffer, index_offset, VK_INDEX_TYPE_UINT16);
 
     /* Setup viewport */
     VkViewport viewport;
@@ -1739,7 +2728,7 @@ static struct overlay_draw *render_swapchain_display(struct swapchain_data *data
     viewport.height = draw_data->DisplaySize.y;
     viewport.minDepth = 0.0f;
     viewport.maxDepth = 1.0f;
-    device_data->vtable.CmdSetViewport(draw->command_buffer, 0, 1, &viewport);
+    device_data->vtable.CmdSetViewport(command_buffer, 0, 1, &viewport);
 
 
     /* Setup scale and translation through push constants :
@@ -1754,10 +2743,10 @@ static struct overlay_draw *render_swapchain_display(struct swapchain_data *data
     float translate[2];
     translate[0] = -1.0f - draw_data->DisplayPos.x * scale[0];
     translate[1] = -1.0f - draw_data->DisplayPos.y * scale[1];
-    device_data->vtable.CmdPushConstants(draw->command_buffer, data->pipeline_layout,
+    device_data->vtable.CmdPushConstants(command_buffer, data->pipeline_layout,
                                          VK_SHADER_STAGE_VERTEX_BIT,
                                          sizeof(float) * 0, sizeof(float) * 2, scale);
-    device_data->vtable.CmdPushConstants(draw->command_buffer, data->pipeline_layout,
+    device_data->vtable.CmdPushConstants(command_buffer, data->pipeline_layout,
                                          VK_SHADER_STAGE_VERTEX_BIT,
                                          sizeof(float) * 2, sizeof(float) * 2, translate);
 
@@ -1778,17 +2767,85 @@ static struct overlay_draw *render_swapchain_display(struct swapchain_data *data
             scissor.offset.y = (int32_t)(pcmd->ClipRect.y - display_pos.y) > 0 ? (int32_t)(pcmd->ClipRect.y - display_pos.y) : 0;
             scissor.extent.width = (uint32_t)(pcmd->ClipRect.z - pcmd->ClipRect.x);
             scissor.extent.height = (uint32_t)(pcmd->ClipRect.w - pcmd->ClipRect.y + 1); // FIXME: Why +1 here?
-            device_data->vtable.CmdSetScissor(draw->command_buffer, 0, 1, &scissor);
+            device_data->vtable.CmdSetScissor(command_buffer, 0, 1, &scissor);
 
             // Draw
-            device_data->vtable.CmdDrawIndexed(draw->command_buffer, pcmd->ElemCount, 1, idx_offset, vtx_offset, 0);
+            device_data->vtable.CmdDrawIndexed(command_buffer, pcmd->ElemCount, 1, idx_offset, vtx_offset, 0);
 
             idx_offset += pcmd->ElemCount;
         }
         vtx_offset += cmd_list->VtxBuffer.Size;
     }
+}
+
+static bool hud_offscreen(struct swapchain_data *data)
+{
+   return data->hud.image != VK_NULL_HANDLE &&
+      data->device->instance->params.hud_refresh_rate;
+}
+
+/* Returns false if there is nothing to submit, the fonts couldn't be uploaded */
+static bool record_overlay_commands(struct swapchain_data *data,
+                                    VkCommandBuffer command_buffer,
+                                    ImDrawData *draw_data,
+                                    VkPipeline pipeline,
+                                    VkDescriptorSet descriptor_set,
+                                    struct queue_data *present_queue,
+                                    unsigned image_index,
+                                    VkBuffer buffer,
+                                    VkDeviceSize vertex_offset,
+                                    VkDeviceSize index_offset)
+{
+   struct device_data *device_data = data->device;
+
+   VkRenderPassBeginInfo render_pass_info = {};
+   render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+   render_pass_info.renderPass = data->render_pass;
+   render_pass_info.framebuffer = data->framebuffers[image_index];
+   render_pass_info.renderArea.extent.width = data->width;
+   render_pass_info.renderArea.extent.height = data->height;
+
+   if (!ensure_swapchain_fonts(data))
+      return false;
+
+   VkCommandBufferBeginInfo buffer_begin_info = {};
+   buffer_begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+
+   device_data->vtable.BeginCommandBuffer(command_buffer, &buffer_begin_info);
 
-   device_data->vtable.CmdEndRenderPass(draw->command_buffer);
+   /* Bounce the image to display back to color attachment layout for
+    * rendering on top of it.
+    */
+   VkImageMemoryBarrier imb;
+   imb.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+   imb.pNext = nullptr;
+   imb.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+   imb.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+   imb.oldLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+   imb.newLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+   imb.image = data->images[image_index];
+   imb.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+   imb.subresourceRange.baseMipLevel = 0;
+   imb.subresourceRange.levelCount = 1;
+   imb.subresourceRange.baseArrayLayer = 0;
+   imb.subresourceRange.layerCount = 1;
+   imb.srcQueueFamilyIndex = present_queue->family_index;
+   imb.dstQueueFamilyIndex = device_data->graphic_queue->family_index;
+   device_data->vtable.CmdPipelineBarrier(command_buffer,
+                                          VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT,
+                                          VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT,
+                                          0,          /* dependency flags */
+                                          0, nullptr, /* memory barriers */
+                                          0, nullptr, /* buffer memory barriers */
+                                          1, &imb);   /* image memory barriers */
+
+   device_data->vtable.CmdBeginRenderPass(command_buffer, &render_pass_info,
+                                          VK_SUBPASS_CONTENTS_INLINE);
+
+   draw_overlay_data(data, command_buffer, draw_data, pipeline, descriptor_set,
+                     buffer, vertex_offset, index_offset);
+
+   device_data->vtable.CmdEndRenderPass(command_buffer);
 
    if (device_data->graphic_queue->family_index != present_queue->family_index)
    {
@@ -1809,7 +2866,7 @@ static struct overlay_draw *render_swapchain_display(struct swapchain_data *data
       imb.subresourceRange.layerCount = 1;
       imb.srcQueueFamilyIndex = device_data->graphic_queue->family_index;
       imb.dstQueueFamilyIndex = present_queue->family_index;
-      device_data->vtable.CmdPipelineBarrier(draw->command_buffer,
+      device_data->vtable.CmdPipelineBarrier(command_buffer,
                                              VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT,
                                              VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT,
                                              0,          /* dependency flags */
@@ -1818,61 +2875,455 @@ static struct overlay_draw *render_swapchain_display(struct swapchain_data *data
                                              1, &imb);   /* image memory barriers */
    }
 
-   device_data->vtable.EndCommandBuffer(draw->command_buffer);
-
-   /* When presenting on a different queue than where we're drawing the
-    * overlay *AND* when the application does not provide a semaphore to
-    * vkQueuePresent, insert our own cross engine synchronization
-    * semaphore.
-    */
-   if (n_wait_semaphores == 0 && device_data->graphic_queue->queue != present_queue->queue) {
-      VkPipelineStageFlags stages_wait = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
-      VkSubmitInfo submit_info = {};
-      submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-      submit_info.commandBufferCount = 0;
-      submit_info.pWaitDstStageMask = &stages_wait;
-      submit_info.waitSemaphoreCount = 0;
-      submit_info.signalSemaphoreCount = 1;
-      submit_info.pSignalSemaphores = &draw->cross_engine_semaphore;
+   device_data->vtable.EndCommandBuffer(command_buffer);
+   return true;
+}
 
-      device_data->vtable.QueueSubmit(present_queue->queue, 1, &submit_info, VK_NULL_HANDLE);
+/* Returns false if the new buffer couldn't be allocated, leaving none */
+static bool resize_overlay_image_cache(struct swapchain_data *data,
+                                       struct overlay_image_cache *cache,
+                                       VkDeviceSize size)
+{
+   struct device_data *device_data = data->device;
 
-      submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-      submit_info.commandBufferCount = 1;
-      submit_info.pWaitDstStageMask = &stages_wait;
-      submit_info.pCommandBuffers = &draw->command_buffer;
-      submit_info.waitSemaphoreCount = 1;
-      submit_info.pWaitSemaphores = &draw->cross_engine_semaphore;
-      submit_info.signalSemaphoreCount = 1;
-      submit_info.pSignalSemaphores = &draw->semaphore;
+   device_data->vtable.DestroyBuffer(device_data->device, cache->buffer, NULL);
+   free_device_memory(device_data, &cache->mem);
 
-      device_data->vtable.QueueSubmit(device_data->graphic_queue->queue, 1, &submit_info, draw->fence);
-   } else {
-      // wait in the fragment stage until the swapchain image is ready
-      std::vector<VkPipelineStageFlags> stages_wait(n_wait_semaphores, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT);
+   cache->size = std::max<VkDeviceSize>(size * 2, 16 * 1024);
 
-      VkSubmitInfo submit_info = {};
-      submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-      submit_info.commandBufferCount = 1;
-      submit_info.pCommandBuffers = &draw->command_buffer;
-      submit_info.pWaitDstStageMask = stages_wait.data();
-      submit_info.waitSemaphoreCount = n_wait_semaphores;
-      submit_info.pWaitSemaphores = wait_semaphores;
-      submit_info.signalSemaphoreCount = 1;
-      submit_info.pSignalSemaphores = &draw->semaphore;
+   VkBufferCreateInfo buffer_info = {};
+   buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+   buffer_info.size = cache->size;
+   buffer_info.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT;
+   buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+   VK_CHECK(device_data->vtable.CreateBuffer(device_data->device, &buffer_info,
+                                             NULL, &cache->buffer));
 
-      device_data->vtable.QueueSubmit(device_data->graphic_queue->queue, 1, &submit_info, draw->fence);
+   VkMemoryRequirements req;
+   device_data->vtable.GetBufferMemoryRequirements(device_data->device,
+                                                   cache->buffer, &req);
+   if (!alloc_device_memory(device_data, req,
+                            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                            &cache->mem)) {
+      device_data->vtable.DestroyBuffer(device_data->device, cache->buffer, NULL);
+      cache->buffer = VK_NULL_HANDLE;
+      cache->size = 0;
+      /* The recorded commands used the old buffer */
+      cache->hash = 0;
+      return false;
    }
+   VK_CHECK(device_data->vtable.BindBufferMemory(device_data->device, cache->buffer,
+                                                 cache->mem.block->memory,
+                                                 cache->mem.offset));
+   return true;
+}
 
-   return draw;
+static bool overlay_image_cache_busy(struct swapchain_data *data,
+                                     struct overlay_image_cache *cache)
+{
+   if (cache->serial > data->completed_serial)
+      retire_overlay_draws(data);
+   return cache->serial > data->completed_serial;
 }
 
-static const uint32_t overlay_vert_spv[] = {
-#include "overlay.vert.spv.h"
-};
-static const uint32_t overlay_frag_spv[] = {
-#include "overlay.frag.spv.h"
+/* Copies 'draw_data' into the cache's buffer and sets 'vertex_size' to
+ * where indices start, returns false if the buffer couldn't grow to fit.
+ */
+static bool upload_overlay_image_cache(struct swapchain_data *data,
+                                       struct overlay_image_cache *cache,
+                                       ImDrawData *draw_data,
+                                       VkDeviceSize *vertex_size)
+{
+   *vertex_size = ALIGN_POT(draw_data->TotalVtxCount * sizeof(ImDrawVert), 16);
+   VkDeviceSize index_size = ALIGN_POT(draw_data->TotalIdxCount * sizeof(ImDrawIdx), 16);
+   if (*vertex_size + index_size > cache->size &&
+       !resize_overlay_image_cache(data, cache, *vertex_size + index_size))
+      return false;
+
+   copy_draw_data(draw_data, cache->mem.map, cache->mem.map + *vertex_size);
+   return true;
+}
+
+/* Renders 'draw_data' into the offscreen HUD image if it changed since last
+ * time. Returns the command buffer to submit for that, if any.
+ */
+static VkCommandBuffer update_hud_image(struct swapchain_data *data,
+                                        struct overlay_draw *draw,
+                                        ImDrawData *draw_data)
+{
+   struct device_data *device_data = data->device;
+   struct overlay_image_cache *cache = &data->hud.cache;
+
+   /* The font is uploaded when first drawing to the swapchain image */
+   if (!data->hud.dirty || !data->font_uploaded || overlay_image_cache_busy(data, cache))
+      return VK_NULL_HANDLE;
+
+   data->hud.dirty = false;
+   uint64_t hash = hash_draw_data(draw_data, 0);
+   if (hash == cache->hash)
+      return VK_NULL_HANDLE;
+
+   VkDeviceSize vertex_size;
+   if (!upload_overlay_image_cache(data, cache, draw_data, &vertex_size)) {
+      /* Drawn directly meanwhile, see render_swapchain_display() */
+      data->hud.dirty = true;
+      return VK_NULL_HANDLE;
+   }
+
+   device_data->vtable.ResetCommandBuffer(cache->command_buffer, 0);
+
+   VkCommandBufferBeginInfo buffer_begin_info = {};
+   buffer_begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+   device_data->vtable.BeginCommandBuffer(cache->command_buffer, &buffer_begin_info);
+
+   VkClearValue clear_value = {};
+   VkRenderPassBeginInfo render_pass_info = {};
+   render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+   render_pass_info.renderPass = data->hud.render_pass;
+   render_pass_info.framebuffer = data->hud.framebuffer;
+   render_pass_info.renderArea.extent.width = data->width;
+   render_pass_info.renderArea.extent.height = data->height;
+   render_pass_info.clearValueCount = 1;
+   render_pass_info.pClearValues = &clear_value;
+   device_data->vtable.CmdBeginRenderPass(cache->command_buffer, &render_pass_info,
+                                          VK_SUBPASS_CONTENTS_INLINE);
+   draw_overlay_data(data, cache->command_buffer, draw_data,
+                     data->hud.pipeline, data->descriptor_set,
+                     cache->buffer, 0, vertex_size);
+   device_data->vtable.CmdEndRenderPass(cache->command_buffer);
+
+   device_data->vtable.EndCommandBuffer(cache->command_buffer);
+
+   cache->hash = hash;
+   cache->serial = draw->serial;
+   update_hud_quad(data->hud.quad, draw_data,
+                   (ImTextureID)(intptr_t)data->hud.image_view, false);
+
+   return cache->command_buffer;
+}
+
+/* Returns the commands cached for 'image_index', re-recorded first if the
+ * HUD changed since they were last submitted. Returns VK_NULL_HANDLE if
+ * they're still in flight, the fonts haven't been uploaded yet or there
+ * was no memory for the new vertices.
+ */
+static VkCommandBuffer get_cached_overlay_commands(struct swapchain_data *data,
+                                                   struct overlay_draw *draw,
+                                                   ImDrawData *draw_data,
+                                                   VkPipeline pipeline,
+                                                   VkDescriptorSet descriptor_set,
+                                                   struct queue_data *present_queue,
+                                                   unsigned image_index)
+{
+   struct device_data *device_data = data->device;
+
+   if (!data->font_uploaded || image_index >= data->image_cache.size())
+      return VK_NULL_HANDLE;
+
+   struct overlay_image_cache *cache = &data->image_cache[image_index];
+   if (overlay_image_cache_busy(data, cache))
+      return VK_NULL_HANDLE;
+
+   uint64_t hash = hash_draw_data(draw_data, HKEY(pipeline) ^ present_queue->family_index);
+   if (hash == cache->hash) {
+      data->n_cmd_reused++;
+   } else {
+      VkDeviceSize vertex_size;
+      if (!upload_overlay_image_cache(data, cache, draw_data, &vertex_size))
+         return VK_NULL_HANDLE;
+
+      device_data->vtable.ResetCommandBuffer(cache->command_buffer, 0);
+      record_overlay_commands(data, cache->command_buffer, draw_data,
+                              pipeline, descriptor_set, present_queue, image_index,
+                              cache->buffer, 0, vertex_size);
+      cache->hash = hash;
+      data->n_cmd_recorded++;
+   }
+
+   cache->serial = draw->serial;
+   return cache->command_buffer;
+}
+
+/* Records the overlay of 'data' and queues it in the present_queue batch */
+static void render_swapchain_display(struct swapchain_data *data,
+                                     struct queue_data *present_queue,
+                                     unsigned image_index)
+{
+   /* Not necessarily laid out this frame, see before_present() */
+   ImGui::SetCurrentContext(data->imgui_context);
+   ImDrawData* draw_data = ImGui::GetDrawData();
+   if (!draw_data || draw_data->TotalVtxCount == 0)
+      return;
+
+   struct device_data *device_data = data->device;
+   struct overlay_batch *batch = &present_queue->batch;
+   struct overlay_draw *draw = get_overlay_draw(data);
+   uint32_t n_command_buffers = 0;
+   VkPipeline pipeline = data->pipeline;
+   VkDescriptorSet descriptor_set = data->descriptor_set;
+
+   if (data->overhead_queries != VK_NULL_HANDLE) {
+      batch->command_buffers.push_back(draw->timestamp_begin);
+      n_command_buffers++;
+   }
+
+   if (hud_offscreen(data)) {
+      VkCommandBuffer hud_command_buffer = update_hud_image(data, draw, draw_data);
+      if (hud_command_buffer != VK_NULL_HANDLE) {
+         batch->command_buffers.push_back(hud_command_buffer);
+         n_command_buffers++;
+      }
+
+      /* Draw directly until the HUD image has content */
+      if (data->hud.cache.hash) {
+         draw_data = &data->hud.quad.draw_data;
+         pipeline = data->hud.blend_pipeline;
+         descriptor_set = data->hud.descriptor_set;
+      }
+   }
+
+   VkCommandBuffer command_buffer =
+      get_cached_overlay_commands(data, draw, draw_data, pipeline, descriptor_set,
+                                  present_queue, image_index);
+
+   if (command_buffer == VK_NULL_HANDLE) {
+      command_buffer = draw->command_buffer;
+      device_data->vtable.ResetCommandBuffer(command_buffer, 0);
+
+      /* Upload vertex & index data, the ring is persistently mapped and
+       * host coherent so there is nothing to map or flush.
+       */
+      VkDeviceSize vertex_size = ALIGN_POT(draw_data->TotalVtxCount * sizeof(ImDrawVert), 16);
+      VkDeviceSize index_size = ALIGN_POT(draw_data->TotalIdxCount * sizeof(ImDrawIdx), 16);
+      VkDeviceSize vertex_offset;
+      if (alloc_overlay_ring(data, draw, vertex_size + index_size, &vertex_offset)) {
+         VkDeviceSize index_offset = vertex_offset + vertex_size;
+
+         copy_draw_data(draw_data, data->ring.map + vertex_offset,
+                        data->ring.map + index_offset);
+
+         if (!record_overlay_commands(data, command_buffer, draw_data,
+                                      pipeline, descriptor_set, present_queue, image_index,
+                                      data->ring.buffer, vertex_offset, index_offset))
+            command_buffer = VK_NULL_HANDLE;
+         data->n_cmd_recorded++;
+      } else {
+         command_buffer = VK_NULL_HANDLE;
+      }
+   }
+
+   /* Without memory for the overlay the draw is still submitted, empty,
+    * since the present waits on its semaphore.
+    */
+   if (command_buffer != VK_NULL_HANDLE) {
+      batch->command_buffers.push_back(command_buffer);
+      n_command_buffers++;
+   }
+
+   if (data->overhead_queries != VK_NULL_HANDLE) {
+      batch->command_buffers.push_back(draw->timestamp_end);
+      n_command_buffers++;
+   }
+
+   batch->swapchains.push_back(data);
+   batch->draws.push_back(draw);
+   batch->n_command_buffers.push_back(n_command_buffers);
+
+#ifndef NDEBUG
+   if ((data->n_cmd_reused + data->n_cmd_recorded) % 1000 == 0)
+      std::cerr << "MANGOHUD: overlay commands reused for "
+                << data->n_cmd_reused * 100 / (data->n_cmd_reused + data->n_cmd_recorded)
+                << "% of frames, " << data->n_draw_waits
+                << " draw(s) waited for a free slot\n";
+#endif
+}
+
+/* Submits the overlay draws queued by one present, and returns the semaphore
+ * the present has to wait on instead of the application's, or
+ * VK_NULL_HANDLE if nothing was drawn.
+ *
+ * With timeline semaphores all draws go out in a single submission that
+ * signals each swapchain's timeline. Without, each draw needs its own
+ * fence and so its own submission, chained through the draw semaphores.
+ * Either way the application's semaphores are waited on exactly once.
+ */
+static VkSemaphore submit_overlay_batch(struct queue_data *present_queue,
+                                        const VkSemaphore *wait_semaphores,
+                                        unsigned n_wait_semaphores)
+{
+   struct overlay_batch *batch = &present_queue->batch;
+   if (batch->draws.empty())
+      return VK_NULL_HANDLE;
+
+   struct device_data *device_data = present_queue->device;
+   VkQueue graphic_queue = device_data->graphic_queue->queue;
+   struct overlay_draw *last_draw = batch->draws.back();
+
+   /* When presenting on a different queue than where we're drawing the
+    * overlay *AND* when the application does not provide a semaphore to
+    * vkQueuePresent, insert our own cross engine synchronization
+    * semaphore.
+    */
+   if (n_wait_semaphores == 0 && graphic_queue != present_queue->queue) {
+      VkSubmitInfo submit_info = {};
+      submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+      submit_info.signalSemaphoreCount = 1;
+      submit_info.pSignalSemaphores = &batch->draws[0]->cross_engine_semaphore;
+
+      device_data->vtable.QueueSubmit(present_queue->queue, 1, &submit_info, VK_NULL_HANDLE);
+
+      wait_semaphores = &batch->draws[0]->cross_engine_semaphore;
+      n_wait_semaphores = 1;
+      batch->stages_wait.assign(1, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+   } else if (device_data->instance->params.self_overhead) {
+      /* Keep the application's rendering out of the overlay's timestamps */
+      batch->stages_wait.assign(n_wait_semaphores, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+   } else {
+      // wait in the fragment stage until the swapchain image is ready
+      batch->stages_wait.assign(n_wait_semaphores, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT);
+   }
+
+   if (device_data->timeline_semaphore) {
+      batch->signal_semaphores.clear();
+      batch->signal_values.clear();
+      for (size_t i = 0; i < batch->draws.size(); i++) {
+         batch->signal_semaphores.push_back(batch->swapchains[i]->timeline);
+         batch->signal_values.push_back(batch->draws[i]->serial);
+      }
+      batch->signal_semaphores.push_back(last_draw->semaphore);
+      batch->signal_values.push_back(0);
+
+      VkTimelineSemaphoreSubmitInfoKHR timeline_info = {};
+      timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR;
+      timeline_info.signalSemaphoreValueCount = batch->signal_values.size();
+      timeline_info.pSignalSemaphoreValues = batch->signal_values.data();
+
+      VkSubmitInfo submit_info = {};
+      submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+      submit_info.pNext = &timeline_info;
+      submit_info.commandBufferCount = batch->command_buffers.size();
+      submit_info.pCommandBuffers = batch->command_buffers.data();
+      submit_info.waitSemaphoreCount = n_wait_semaphores;
+      submit_info.pWaitSemaphores = wait_semaphores;
+      submit_info.pWaitDstStageMask = batch->stages_wait.data();
+      submit_info.signalSemaphoreCount = batch->signal_semaphores.size();
+      submit_info.pSignalSemaphores = batch->signal_semaphores.data();
+
+      device_data->vtable.QueueSubmit(graphic_queue, 1, &submit_info, VK_NULL_HANDLE);
+      return last_draw->semaphore;
+   }
+
+   VkPipelineStageFlags stage_chain = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+   const VkCommandBuffer *command_buffers = batch->command_buffers.data();
+   for (size_t i = 0; i < batch->draws.size(); i++) {
+      VkSubmitInfo submit_info = {};
+      submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+      submit_info.commandBufferCount = batch->n_command_buffers[i];
+      submit_info.pCommandBuffers = command_buffers;
+      if (i == 0) {
+         submit_info.waitSemaphoreCount = n_wait_semaphores;
+         submit_info.pWaitSemaphores = wait_semaphores;
+         submit_info.pWaitDstStageMask = batch->stages_wait.data();
+      } else {
+         submit_info.waitSemaphoreCount = 1;
+         submit_info.pWaitSemaphores = &batch->draws[i - 1]->semaphore;
+         submit_info.pWaitDstStageMask = &stage_chain;
+      }
+      submit_info.signalSemaphoreCount = 1;
+      submit_info.pSignalSemaphores = &batch->draws[i]->semaphore;
+
+      device_data->vtable.QueueSubmit(graphic_queue, 1, &submit_info, batch->draws[i]->fence);
+      command_buffers += batch->n_command_buffers[i];
+   }
+
+   return last_draw->semaphore;
+}
+
+static const uint32_t overlay_vert_spv[] = {
+#include "overlay.vert.spv.h"
 };
+static const uint32_t overlay_frag_spv[] = {
+#include "overlay.frag.spv.h"
+};
+
+/* Returns the device's copy of 'atlas', creating the image on first use.
+ * It gets filled by the first draw that needs it, see
+ * ensure_swapchain_fonts(). NULL if there was no memory for the image.
+ */
+static struct device_font *get_device_font(struct device_data *device_data,
+                                           ImFontAtlas *atlas)
+{
+   scoped_lock lk(device_data->font_lock);
+
+   for (auto font : device_data->fonts) {
+      if (font->atlas == atlas)
+         return font;
+   }
+
+   struct device_font *font = new device_font();
+   font->atlas = atlas;
+
+   unsigned char* pixels;
+   int width, height;
+   atlas->GetTexDataAsRGBA32(&pixels, &width, &height);
+
+   /* Font image */
+   VkImageCreateInfo image_info = {};
+   image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+   image_info.imageType = VK_IMAGE_TYPE_2D;
+   image_info.format = VK_FORMAT_R8G8B8A8_UNORM;
+   image_info.extent.width = width;
+   image_info.extent.height = height;
+   image_info.extent.depth = 1;
+   image_info.mipLevels = 1;
+   image_info.arrayLayers = 1;
+   image_info.samples = VK_SAMPLE_COUNT_1_BIT;
+   image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+   image_info.usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+   image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+   image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+   VK_CHECK(device_data->vtable.CreateImage(device_data->device, &image_info,
+                                            NULL, &font->image));
+   VkMemoryRequirements font_image_req;
+   device_data->vtable.GetImageMemoryRequirements(device_data->device,
+                                                  font->image, &font_image_req);
+   if (!alloc_device_memory(device_data, font_image_req,
+                            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &font->mem)) {
+      device_data->vtable.DestroyImage(device_data->device, font->image, NULL);
+      delete font;
+      return NULL;
+   }
+   VK_CHECK(device_data->vtable.BindImageMemory(device_data->device,
+                                                font->image,
+                                                font->mem.block->memory,
+                                                font->mem.offset));
+
+   /* Font image view */
+   VkImageViewCreateInfo view_info = {};
+   view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+   view_info.image = font->image;
+   view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+   view_info.format = VK_FORMAT_R8G8B8A8_UNORM;
+   view_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+   view_info.subresourceRange.levelCount = 1;
+   view_info.subresourceRange.layerCount = 1;
+   VK_CHECK(device_data->vtable.CreateImageView(device_data->device, &view_info,
+                                                NULL, &font->image_view));
+
+   device_data->fonts.push_back(font);
+   return font;
+}
+
+static void destroy_device_fonts(struct device_data *device_data)
+{
+   for (auto font : device_data->fonts) {
+      device_data->vtable.DestroyImageView(device_data->device, font->image_view, NULL);
+      device_data->vtable.DestroyImage(device_data->device, font->image, NULL);
+      free_device_memory(device_data, &font->mem);
+      delete font;
+   }
+   device_data->fonts.clear();
+}
 
 static void setup_swapchain_data_pipeline(struct swapchain_data *data)
 {
@@ -1911,10 +3362,10 @@ static void setup_swapchain_data_pipeline(struct swapchain_data *data)
    /* Descriptor pool */
    VkDescriptorPoolSize sampler_pool_size = {};
    sampler_pool_size.type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-   sampler_pool_size.descriptorCount = 1;
+   sampler_pool_size.descriptorCount = 2;
    VkDescriptorPoolCreateInfo desc_pool_info = {};
    desc_pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-   desc_pool_info.maxSets = 1;
+   desc_pool_info.maxSets = 2; /* Font, offscreen HUD */
    desc_pool_info.poolSizeCount = 1;
    desc_pool_info.pPoolSizes = &sampler_pool_size;
    VK_CHECK(device_data->vtable.CreateDescriptorPool(device_data->device,
@@ -2058,120 +3509,169 @@ static void setup_swapchain_data_pipeline(struct swapchain_data *data)
    info.pDynamicState = &dynamic_state;
    info.layout = data->pipeline_layout;
    info.renderPass = data->render_pass;
+#ifndef NDEBUG
+   uint64_t pipeline_start = os_time_get();
+#endif
    VK_CHECK(
-      device_data->vtable.CreateGraphicsPipelines(device_data->device, VK_NULL_HANDLE,
+      device_data->vtable.CreateGraphicsPipelines(device_data->device, device_data->pipeline_cache,
                                                   1, &info,
                                                   NULL, &data->pipeline));
 
+   if (data->hud.render_pass) {
+      /* Accumulate premultiplied alpha into the offscreen HUD image... */
+      color_attachment[0].srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+      color_attachment[0].dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+      info.renderPass = data->hud.render_pass;
+      VK_CHECK(
+         device_data->vtable.CreateGraphicsPipelines(device_data->device, device_data->pipeline_cache,
+                                                     1, &info,
+                                                     NULL, &data->hud.pipeline));
+
+      /* ...and blend it as such */
+      color_attachment[0].srcColorBlendFactor = VK_BLEND_FACTOR_ONE;
+      color_attachment[0].srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+      color_attachment[0].dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+      info.renderPass = data->render_pass;
+      VK_CHECK(
+         device_data->vtable.CreateGraphicsPipelines(device_data->device, device_data->pipeline_cache,
+                                                     1, &info,
+                                                     NULL, &data->hud.blend_pipeline));
+   }
+#ifndef NDEBUG
+   std::cerr << "MANGOHUD: overlay pipelines created in "
+             << os_time_get() - pipeline_start << " us\n";
+#endif
+
+   save_pipeline_cache(device_data);
+
    device_data->vtable.DestroyShaderModule(device_data->device, vert_module, NULL);
    device_data->vtable.DestroyShaderModule(device_data->device, frag_module, NULL);
 
-   ImGuiIO& io = ImGui::GetIO();
-   int font_size = device_data->instance->params.font_size;
-   if (!font_size)
-      font_size = 24;
+   /* Nothing gets drawn without it, see ensure_swapchain_fonts() */
+   data->device_font = get_device_font(device_data, ImGui::GetIO().Fonts);
+   if (!data->device_font)
+      return;
 
-   // ImGui takes ownership of the data, no need to free it
-   if (!device_data->instance->params.font_file.empty() && file_exists(device_data->instance->params.font_file)) {
-      data->font = io.Fonts->AddFontFromFileTTF(device_data->instance->params.font_file.c_str(), font_size);
-      data->sw_stats.font1 = io.Fonts->AddFontFromFileTTF(device_data->instance->params.font_file.c_str(), font_size * 0.55f);
-   } else {
-      ImFontConfig font_cfg = ImFontConfig();
-      const char* ttf_compressed_base85 = GetDefaultCompressedFontDataTTFBase85();
-      const ImWchar* glyph_ranges = io.Fonts->GetGlyphRangesDefault();
+   /* Descriptor set */
+   VkDescriptorImageInfo desc_image[1] = {};
+   desc_image[0].sampler = data->font_sampler;
+   desc_image[0].imageView = data->device_font->image_view;
+   desc_image[0].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+   VkWriteDescriptorSet write_desc[1] = {};
+   write_desc[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+   write_desc[0].dstSet = data->descriptor_set;
+   write_desc[0].descriptorCount = 1;
+   write_desc[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+   write_desc[0].pImageInfo = desc_image;
+   device_data->vtable.UpdateDescriptorSets(device_data->device, 1, write_desc, 0, NULL);
+}
 
-      data->font = io.Fonts->AddFontFromMemoryCompressedBase85TTF(ttf_compressed_base85, font_size, &font_cfg, glyph_ranges);
-      data->sw_stats.font1 = io.Fonts->AddFontFromMemoryCompressedBase85TTF(ttf_compressed_base85, font_size * 0.55, &font_cfg, glyph_ranges);
-   }
-   unsigned char* pixels;
-   int width, height;
-   io.Fonts->GetTexDataAsRGBA32(&pixels, &width, &height);
+void imgui_custom_style(struct overlay_params& params){
+   ImGuiStyle& style = ImGui::GetStyle();
+   style.Colors[ImGuiCol_PlotLines] = ImGui::ColorConvertU32ToFloat4(params.frametime_color);
+   style.Colors[ImGuiCol_WindowBg]  = ImGui::ColorConvertU32ToFloat4(params.background_color);
+   style.Colors[ImGuiCol_Text] = ImGui::ColorConvertU32ToFloat4(params.text_color);
+   style.CellPadding.y = -2;
+}
+
+static void setup_swapchain_data_hud(struct swapchain_data *data)
+{
+   struct device_data *device_data = data->device;
 
-   /* Font image */
    VkImageCreateInfo image_info = {};
    image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
    image_info.imageType = VK_IMAGE_TYPE_2D;
    image_info.format = VK_FORMAT_R8G8B8A8_UNORM;
-   image_info.extent.width = width;
-   image_info.extent.height = height;
+   image_info.extent.width = data->width;
+   image_info.extent.height = data->height;
    image_info.extent.depth = 1;
    image_info.mipLevels = 1;
    image_info.arrayLayers = 1;
    image_info.samples = VK_SAMPLE_COUNT_1_BIT;
    image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
-   image_info.usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+   image_info.usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
    image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
    image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
    VK_CHECK(device_data->vtable.CreateImage(device_data->device, &image_info,
-                                            NULL, &data->font_image));
-   VkMemoryRequirements font_image_req;
+                                            NULL, &data->hud.image));
+   VkMemoryRequirements image_req;
    device_data->vtable.GetImageMemoryRequirements(device_data->device,
-                                                  data->font_image, &font_image_req);
-   VkMemoryAllocateInfo image_alloc_info = {};
-   image_alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-   image_alloc_info.allocationSize = font_image_req.size;
-   image_alloc_info.memoryTypeIndex = vk_memory_type(device_data,
-                                                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                                                     font_image_req.memoryTypeBits);
-   VK_CHECK(device_data->vtable.AllocateMemory(device_data->device, &image_alloc_info,
-                                               NULL, &data->font_mem));
+                                                  data->hud.image, &image_req);
+   if (!alloc_device_memory(device_data, image_req,
+                            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &data->hud.mem)) {
+      /* The HUD is drawn directly instead, see hud_offscreen() */
+      device_data->vtable.DestroyImage(device_data->device, data->hud.image, NULL);
+      data->hud.image = VK_NULL_HANDLE;
+      return;
+   }
    VK_CHECK(device_data->vtable.BindImageMemory(device_data->device,
-                                                data->font_image,
-                                                data->font_mem, 0));
+                                                data->hud.image,
+                                                data->hud.mem.block->memory,
+                                                data->hud.mem.offset));
 
-   /* Font image view */
    VkImageViewCreateInfo view_info = {};
    view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-   view_info.image = data->font_image;
+   view_info.image = data->hud.image;
    view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
    view_info.format = VK_FORMAT_R8G8B8A8_UNORM;
-   view_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-   view_info.subresourceRange.levelCount = 1;
-   view_info.subresourceRange.layerCount = 1;
+   view_info.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
    VK_CHECK(device_data->vtable.CreateImageView(device_data->device, &view_info,
-                                                NULL, &data->font_image_view));
+                                                NULL, &data->hud.image_view));
+
+   VkFramebufferCreateInfo fb_info = {};
+   fb_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+   fb_info.renderPass = data->hud.render_pass;
+   fb_info.attachmentCount = 1;
+   fb_info.pAttachments = &data->hud.image_view;
+   fb_info.width = data->width;
+   fb_info.height = data->height;
+   fb_info.layers = 1;
+   VK_CHECK(device_data->vtable.CreateFramebuffer(device_data->device, &fb_info,
+                                                  NULL, &data->hud.framebuffer));
+
+   /* Adopted from the previous swapchain along with the pool */
+   if (data->hud.descriptor_set == VK_NULL_HANDLE) {
+      VkDescriptorSetAllocateInfo alloc_info = {};
+      alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+      alloc_info.descriptorPool = data->descriptor_pool;
+      alloc_info.descriptorSetCount = 1;
+      alloc_info.pSetLayouts = &data->descriptor_layout;
+      VK_CHECK(device_data->vtable.AllocateDescriptorSets(device_data->device,
+                                                          &alloc_info,
+                                                          &data->hud.descriptor_set));
+   }
 
-   /* Descriptor set */
    VkDescriptorImageInfo desc_image[1] = {};
    desc_image[0].sampler = data->font_sampler;
-   desc_image[0].imageView = data->font_image_view;
+   desc_image[0].imageView = data->hud.image_view;
    desc_image[0].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
    VkWriteDescriptorSet write_desc[1] = {};
    write_desc[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-   write_desc[0].dstSet = data->descriptor_set;
+   write_desc[0].dstSet = data->hud.descriptor_set;
    write_desc[0].descriptorCount = 1;
    write_desc[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
    write_desc[0].pImageInfo = desc_image;
    device_data->vtable.UpdateDescriptorSets(device_data->device, 1, write_desc, 0, NULL);
-}
 
-void imgui_custom_style(struct overlay_params& params){
-   ImGuiStyle& style = ImGui::GetStyle();
-   style.Colors[ImGuiCol_PlotLines] = ImGui::ColorConvertU32ToFloat4(params.frametime_color);
-   style.Colors[ImGuiCol_WindowBg]  = ImGui::ColorConvertU32ToFloat4(params.background_color);
-   style.Colors[ImGuiCol_Text] = ImGui::ColorConvertU32ToFloat4(params.text_color);
-   style.CellPadding.y = -2;
+   VkCommandBufferAllocateInfo cmd_buffer_info = {};
+   cmd_buffer_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+   cmd_buffer_info.commandPool = data->command_pool;
+   cmd_buffer_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+   cmd_buffer_info.commandBufferCount = 1;
+   VK_CHECK(device_data->vtable.AllocateCommandBuffers(device_data->device,
+                                                       &cmd_buffer_info,
+                                                       &data->hud.cache.command_buffer));
+   VK_CHECK(device_data->set_device_loader_data(device_data->device,
+                                                data->hud.cache.command_buffer));
 }
 
-static void setup_swapchain_data(struct swapchain_data *data,
-                                 const VkSwapchainCreateInfoKHR *pCreateInfo, struct overlay_params& params)
+static void setup_swapchain_data_render_pass(struct swapchain_data *data,
+                                             struct overlay_params& params)
 {
-   data->width = pCreateInfo->imageExtent.width;
-   data->height = pCreateInfo->imageExtent.height;
-   data->format = pCreateInfo->imageFormat;
-
-   data->imgui_context = ImGui::CreateContext();
-   ImGui::SetCurrentContext(data->imgui_context);
-
-   ImGui::GetIO().IniFilename = NULL;
-   ImGui::GetIO().DisplaySize = ImVec2((float)data->width, (float)data->height);
-   imgui_custom_style(params);
-
    struct device_data *device_data = data->device;
 
-   /* Render pass */
    VkAttachmentDescription attachment_desc = {};
-   attachment_desc.format = pCreateInfo->imageFormat;
+   attachment_desc.format = data->format;
    attachment_desc.samples = VK_SAMPLE_COUNT_1_BIT;
    attachment_desc.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
    attachment_desc.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
@@ -2205,17 +3705,262 @@ static void setup_swapchain_data(struct swapchain_data *data,
                                                  &render_pass_info,
                                                  NULL, &data->render_pass));
 
-   setup_swapchain_data_pipeline(data);
+   if (params.hud_refresh_rate) {
+      /* Offscreen HUD, cleared and left ready for sampling */
+      attachment_desc.format = VK_FORMAT_R8G8B8A8_UNORM;
+      attachment_desc.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+      attachment_desc.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+      attachment_desc.finalLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+      VkSubpassDependency hud_dependencies[2] = {};
+      /* Previous frames may still be blending the image */
+      hud_dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+      hud_dependencies[0].dstSubpass = 0;
+      hud_dependencies[0].srcStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+      hud_dependencies[0].dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+      hud_dependencies[0].srcAccessMask = 0;
+      hud_dependencies[0].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+      hud_dependencies[1].srcSubpass = 0;
+      hud_dependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
+      hud_dependencies[1].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+      hud_dependencies[1].dstStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+      hud_dependencies[1].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+      hud_dependencies[1].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+      render_pass_info.dependencyCount = 2;
+      render_pass_info.pDependencies = hud_dependencies;
+      VK_CHECK(device_data->vtable.CreateRenderPass(device_data->device,
+                                                    &render_pass_info,
+                                                    NULL, &data->hud.render_pass));
+   }
+}
 
-   uint32_t n_images = 0;
-   VK_CHECK(device_data->vtable.GetSwapchainImagesKHR(device_data->device,
-                                                      data->swapchain,
-                                                      &n_images,
-                                                      NULL));
+/* Whether what adopt_swapchain_data() carries over from 'old' works with
+ * a swapchain created from 'pCreateInfo'.
+ */
+static bool swapchain_data_compatible(struct swapchain_data *old,
+                                      const VkSwapchainCreateInfoKHR *pCreateInfo,
+                                      struct overlay_params& params)
+{
+   return old->format == pCreateInfo->imageFormat &&
+          (old->hud.render_pass != VK_NULL_HANDLE) == (params.hud_refresh_rate != 0);
+}
 
-   data->images.resize(n_images);
-   data->image_views.resize(n_images);
-   data->framebuffers.resize(n_images);
+/* Moves everything that doesn't depend on the swapchain images from the
+ * retired swapchain 'old' to 'data': ImGui context and fonts, render
+ * passes, pipelines, descriptors, the vertex ring and the stats. 'old' is
+ * left with null handles and marked retired, destroying it only releases
+ * its image state.
+ */
+static void adopt_swapchain_data(struct swapchain_data *data,
+                                 struct swapchain_data *old)
+{
+   /* The HUD descriptor gets rewritten and the ring restarted */
+   wait_overlay_draws(old, old->draw_serial);
+   retire_overlay_draws(old);
+
+   std::swap(data->imgui_context, old->imgui_context);
+   data->font = old->font;
+   data->font_uploaded = old->font_uploaded;
+   data->device_font = old->device_font;
+   std::swap(data->font_sampler, old->font_sampler);
+
+   std::swap(data->render_pass, old->render_pass);
+   std::swap(data->descriptor_pool, old->descriptor_pool);
+   std::swap(data->descriptor_layout, old->descriptor_layout);
+   std::swap(data->descriptor_set, old->descriptor_set);
+   std::swap(data->pipeline_layout, old->pipeline_layout);
+   std::swap(data->pipeline, old->pipeline);
+
+   std::swap(data->hud.render_pass, old->hud.render_pass);
+   std::swap(data->hud.pipeline, old->hud.pipeline);
+   std::swap(data->hud.blend_pipeline, old->hud.blend_pipeline);
+   std::swap(data->hud.descriptor_set, old->hud.descriptor_set);
+
+   std::swap(data->ring, old->ring);
+   data->ring.head = data->ring.tail = 0;
+
+   data->last_present_time = old->last_present_time;
+   data->n_frames_since_update = old->n_frames_since_update;
+   data->last_fps_update = old->last_fps_update;
+   data->frametime = old->frametime;
+   data->frametimeDisplay = old->frametimeDisplay;
+   data->sw_stats = old->sw_stats;
+   data->frame_stats = old->frame_stats;
+   data->accumulated_stats = old->accumulated_stats;
+   old->retired = true;
+}
+
+/* Timestamp queries and the command buffers writing them around every
+ * draw, for self_overhead.
+ */
+static void setup_overhead_queries(struct swapchain_data *data)
+{
+   struct device_data *device_data = data->device;
+
+   VkQueryPoolCreateInfo pool_info = {};
+   pool_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+   pool_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+   pool_info.queryCount = 2 * data->draws.size();
+   VK_CHECK(device_data->vtable.CreateQueryPool(device_data->device, &pool_info,
+                                                NULL, &data->overhead_queries));
+
+   for (size_t i = 0; i < data->draws.size(); i++) {
+      struct overlay_draw *draw = &data->draws[i];
+      uint32_t query = 2 * i;
+
+      VkCommandBuffer command_buffers[2];
+      VkCommandBufferAllocateInfo cmd_buffer_info = {};
+      cmd_buffer_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+      cmd_buffer_info.commandPool = data->command_pool;
+      cmd_buffer_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+      cmd_buffer_info.commandBufferCount = 2;
+      VK_CHECK(device_data->vtable.AllocateCommandBuffers(device_data->device,
+                                                          &cmd_buffer_info,
+                                                          command_buffers));
+
+      VkCommandBufferBeginInfo begin_info = {};
+      begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+      for (unsigned c = 0; c < 2; c++) {
+         VK_CHECK(device_data->set_device_loader_data(device_data->device,
+                                                      command_buffers[c]));
+         device_data->vtable.BeginCommandBuffer(command_buffers[c], &begin_info);
+         if (c == 0) {
+            device_data->vtable.CmdResetQueryPool(command_buffers[c],
+                                                  data->overhead_queries, query, 2);
+            device_data->vtable.CmdWriteTimestamp(command_buffers[c],
+                                                  VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                                                  data->overhead_queries, query);
+         } else {
+            device_data->vtable.CmdWriteTimestamp(command_buffers[c],
+                                                  VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                                                  data->overhead_queries, query + 1);
+         }
+         device_data->vtable.EndCommandBuffer(command_buffers[c]);
+      }
+      draw->timestamp_begin = command_buffers[0];
+      draw->timestamp_end = command_buffers[1];
+   }
+}
+
+/* GPU time of the last completed overlay draw, us. Kept from the previous
+ * read while no newer draw completed.
+ */
+static uint64_t read_overhead_queries(struct swapchain_data *data)
+{
+   struct device_data *device_data = data->device;
+   uint64_t gpu_time = data->sw_stats.layer_gpu_time;
+
+   update_completed_serial(data);
+   uint64_t serial = data->completed_serial;
+   if (!serial || serial == data->overhead_read_serial)
+      return gpu_time;
+
+   /* The slot may already be recorded again for a newer draw */
+   uint32_t index = serial % data->draws.size();
+   if (data->draws[index].serial != serial)
+      return gpu_time;
+
+   uint64_t timestamps[2];
+   if (device_data->vtable.GetQueryPoolResults(device_data->device, data->overhead_queries,
+                                               2 * index, 2, sizeof(timestamps), timestamps,
+                                               sizeof(uint64_t),
+                                               VK_QUERY_RESULT_64_BIT) != VK_SUCCESS)
+      return gpu_time;
+   data->overhead_read_serial = serial;
+
+   uint32_t valid_bits = device_data->graphic_queue->timestamp_valid_bits;
+   uint64_t mask = valid_bits >= 64 ? ~0ull : (1ull << valid_bits) - 1;
+   uint64_t ticks = (timestamps[1] - timestamps[0]) & mask;
+   return ticks * device_data->properties.limits.timestampPeriod / 1000;
+}
+
+/* Estimate of the host memory the HUD of a swapchain holds, bytes: the
+ * draw lists of its ImGui context, the pixels of the font atlas it shares
+ * and the log buffers. ImGui's smaller allocations are left out.
+ */
+static uint64_t layer_host_memory(struct swapchain_data *data)
+{
+   uint64_t size = 2 * BUF_SIZE * sizeof(logData);
+
+   ImGui::SetCurrentContext(data->imgui_context);
+   const ImFontAtlas *atlas = ImGui::GetIO().Fonts;
+   uint64_t n_pixels = (uint64_t)atlas->TexWidth * atlas->TexHeight;
+   if (atlas->TexPixelsRGBA32)
+      size += n_pixels * 4;
+   if (atlas->TexPixelsAlpha8)
+      size += n_pixels;
+
+   const ImDrawData *draw_data = ImGui::GetDrawData();
+   for (int i = 0; draw_data && i < draw_data->CmdListsCount; i++) {
+      const ImDrawList *list = draw_data->CmdLists[i];
+      size += list->VtxBuffer.Capacity * sizeof(ImDrawVert) +
+              list->IdxBuffer.Capacity * sizeof(ImDrawIdx) +
+              list->CmdBuffer.Capacity * sizeof(ImDrawCmd);
+   }
+   return size;
+}
+
+/* Hands the self_overhead measured during the previous present to the
+ * frame's stats.
+ */
+static void set_overhead_stats(struct swapchain_data *data)
+{
+   struct device_data *device_data = data->device;
+   struct swapchain_stats& sw_stats = data->sw_stats;
+
+   sw_stats.self_overhead = true;
+   sw_stats.layer_cpu_time = data->layer_cpu_time / 1000;
+   sw_stats.layer_layout_time = data->layout_cpu_time / 1000;
+   if (data->overhead_queries != VK_NULL_HANDLE)
+      sw_stats.layer_gpu_time = read_overhead_queries(data);
+   sw_stats.layer_host_memory = layer_host_memory(data);
+   uint64_t n_cmd = data->n_cmd_reused + data->n_cmd_recorded;
+   sw_stats.layer_cmd_reuse = n_cmd ? data->n_cmd_reused * 100 / n_cmd : 0;
+
+   scoped_lock lk(device_data->memory_lock);
+   sw_stats.layer_device_memory = device_data->memory_allocated;
+}
+
+static void setup_swapchain_data(struct swapchain_data *data,
+                                 const VkSwapchainCreateInfoKHR *pCreateInfo, struct overlay_params& params)
+{
+   data->width = pCreateInfo->imageExtent.width;
+   data->height = pCreateInfo->imageExtent.height;
+   data->format = pCreateInfo->imageFormat;
+
+   struct device_data *device_data = data->device;
+
+   /* Recreated swapchains only need new image views and framebuffers */
+   struct swapchain_data *old = NULL;
+   if (pCreateInfo->oldSwapchain != VK_NULL_HANDLE)
+      old = FIND(struct swapchain_data, pCreateInfo->oldSwapchain);
+
+   if (old && swapchain_data_compatible(old, pCreateInfo, params)) {
+      adopt_swapchain_data(data, old);
+      ImGui::SetCurrentContext(data->imgui_context);
+      ImGui::GetIO().DisplaySize = ImVec2((float)data->width, (float)data->height);
+   } else {
+      data->imgui_context =
+         ImGui::CreateContext(get_shared_font_atlas(params, &data->font,
+                                                    &data->sw_stats.font1));
+      ImGui::SetCurrentContext(data->imgui_context);
+
+      ImGui::GetIO().IniFilename = NULL;
+      ImGui::GetIO().DisplaySize = ImVec2((float)data->width, (float)data->height);
+      imgui_custom_style(params);
+
+      setup_swapchain_data_render_pass(data, params);
+      setup_swapchain_data_pipeline(data);
+   }
+
+   uint32_t n_images = 0;
+   VK_CHECK(device_data->vtable.GetSwapchainImagesKHR(device_data->device,
+                                                      data->swapchain,
+                                                      &n_images,
+                                                      NULL));
+
+   data->images.resize(n_images);
+   data->image_views.resize(n_images);
+   data->framebuffers.resize(n_images);
 
    VK_CHECK(device_data->vtable.GetSwapchainImagesKHR(device_data->device,
                                                       data->swapchain,
@@ -2270,22 +4015,104 @@ static void setup_swapchain_data(struct swapchain_data *data,
    VK_CHECK(device_data->vtable.CreateCommandPool(device_data->device,
                                                   &cmd_buffer_pool_info,
                                                   NULL, &data->command_pool));
+
+   /* One draw more than images, so presenting every image doesn't have to
+    * wait on the oldest draw.
+    */
+   data->draws.resize(data->images.size() + 1);
+   for (auto& draw : data->draws) {
+      VkCommandBufferAllocateInfo cmd_buffer_info = {};
+      cmd_buffer_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+      cmd_buffer_info.commandPool = data->command_pool;
+      cmd_buffer_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+      cmd_buffer_info.commandBufferCount = 1;
+      VK_CHECK(device_data->vtable.AllocateCommandBuffers(device_data->device,
+                                                          &cmd_buffer_info,
+                                                          &draw.command_buffer));
+      VK_CHECK(device_data->set_device_loader_data(device_data->device,
+                                                   draw.command_buffer));
+
+      if (!device_data->timeline_semaphore) {
+         VkFenceCreateInfo fence_info = {};
+         fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+         VK_CHECK(device_data->vtable.CreateFence(device_data->device,
+                                                  &fence_info,
+                                                  NULL,
+                                                  &draw.fence));
+      }
+
+      VkSemaphoreCreateInfo sem_info = {};
+      sem_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+      VK_CHECK(device_data->vtable.CreateSemaphore(device_data->device, &sem_info,
+                                                   NULL, &draw.semaphore));
+      VK_CHECK(device_data->vtable.CreateSemaphore(device_data->device, &sem_info,
+                                                   NULL, &draw.cross_engine_semaphore));
+   }
+
+   if (device_data->timeline_semaphore) {
+      VkSemaphoreTypeCreateInfoKHR type_info = {};
+      type_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO_KHR;
+      type_info.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE_KHR;
+      type_info.initialValue = 0;
+      VkSemaphoreCreateInfo sem_info = {};
+      sem_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+      sem_info.pNext = &type_info;
+      VK_CHECK(device_data->vtable.CreateSemaphore(device_data->device, &sem_info,
+                                                   NULL, &data->timeline));
+   }
+
+   if (params.self_overhead && device_data->graphic_queue->timestamp_valid_bits)
+      setup_overhead_queries(data);
+
+   data->image_cache.resize(data->images.size());
+   for (auto& cache : data->image_cache) {
+      VkCommandBufferAllocateInfo cmd_buffer_info = {};
+      cmd_buffer_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+      cmd_buffer_info.commandPool = data->command_pool;
+      cmd_buffer_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+      cmd_buffer_info.commandBufferCount = 1;
+      VK_CHECK(device_data->vtable.AllocateCommandBuffers(device_data->device,
+                                                          &cmd_buffer_info,
+                                                          &cache.command_buffer));
+      VK_CHECK(device_data->set_device_loader_data(device_data->device,
+                                                   cache.command_buffer));
+   }
+
+   if (data->hud.render_pass)
+      setup_swapchain_data_hud(data);
 }
 
 static void shutdown_swapchain_data(struct swapchain_data *data)
 {
    struct device_data *device_data = data->device;
 
-   for (auto draw : data->draws) {
-      device_data->vtable.DestroySemaphore(device_data->device, draw->cross_engine_semaphore, NULL);
-      device_data->vtable.DestroySemaphore(device_data->device, draw->semaphore, NULL);
-      device_data->vtable.DestroyFence(device_data->device, draw->fence, NULL);
-      device_data->vtable.DestroyBuffer(device_data->device, draw->vertex_buffer, NULL);
-      device_data->vtable.DestroyBuffer(device_data->device, draw->index_buffer, NULL);
-      device_data->vtable.FreeMemory(device_data->device, draw->vertex_buffer_mem, NULL);
-      device_data->vtable.FreeMemory(device_data->device, draw->index_buffer_mem, NULL);
-      delete draw;
+   for (auto& draw : data->draws) {
+      device_data->vtable.DestroySemaphore(device_data->device, draw.cross_engine_semaphore, NULL);
+      device_data->vtable.DestroySemaphore(device_data->device, draw.semaphore, NULL);
+      device_data->vtable.DestroyFence(device_data->device, draw.fence, NULL);
    }
+   data->draws.clear();
+   device_data->vtable.DestroySemaphore(device_data->device, data->timeline, NULL);
+   device_data->vtable.DestroyQueryPool(device_data->device, data->overhead_queries, NULL);
+   data->overhead_queries = VK_NULL_HANDLE;
+
+   destroy_overlay_ring(data);
+
+   for (auto& cache : data->image_cache) {
+      device_data->vtable.DestroyBuffer(device_data->device, cache.buffer, NULL);
+      free_device_memory(device_data, &cache.mem);
+   }
+   data->image_cache.clear();
+
+   device_data->vtable.DestroyBuffer(device_data->device, data->hud.cache.buffer, NULL);
+   free_device_memory(device_data, &data->hud.cache.mem);
+   device_data->vtable.DestroyFramebuffer(device_data->device, data->hud.framebuffer, NULL);
+   device_data->vtable.DestroyImageView(device_data->device, data->hud.image_view, NULL);
+   device_data->vtable.DestroyImage(device_data->device, data->hud.image, NULL);
+   free_device_memory(device_data, &data->hud.mem);
+   device_data->vtable.DestroyPipeline(device_data->device, data->hud.pipeline, NULL);
+   device_data->vtable.DestroyPipeline(device_data->device, data->hud.blend_pipeline, NULL);
+   device_data->vtable.DestroyRenderPass(device_data->device, data->hud.render_pass, NULL);
 
    for (size_t i = 0; i < data->images.size(); i++) {
       device_data->vtable.DestroyImageView(device_data->device, data->image_views[i], NULL);
@@ -2305,34 +4132,339 @@ static void shutdown_swapchain_data(struct swapchain_data *data)
                                                   data->descriptor_layout, NULL);
 
    device_data->vtable.DestroySampler(device_data->device, data->font_sampler, NULL);
-   device_data->vtable.DestroyImageView(device_data->device, data->font_image_view, NULL);
-   device_data->vtable.DestroyImage(device_data->device, data->font_image, NULL);
-   device_data->vtable.FreeMemory(device_data->device, data->font_mem, NULL);
 
-   device_data->vtable.DestroyBuffer(device_data->device, data->upload_font_buffer, NULL);
-   device_data->vtable.FreeMemory(device_data->device, data->upload_font_buffer_mem, NULL);
+   /* NULL would destroy the current context */
+   if (data->imgui_context)
+      ImGui::DestroyContext(data->imgui_context);
+}
+
+struct compile_stats {
+   uint32_t n_pipelines, n_cache_hits;
+   uint64_t compile_time;
+};
 
-   ImGui::DestroyContext(data->imgui_context);
+/* Takes the pipelines created since the last present, they count towards
+ * the frame of every swapchain in the present.
+ */
+static struct compile_stats take_compile_stats(struct device_data *device_data)
+{
+   struct compile_stats stats = {};
+   if (device_data->hooks & OVERLAY_HOOKS_PIPELINE) {
+      stats.n_pipelines = device_data->n_pipelines.exchange(0);
+      stats.n_cache_hits = device_data->n_cache_hits.exchange(0);
+      stats.compile_time = device_data->compile_time.exchange(0);
+   }
+   return stats;
 }
 
-static struct overlay_draw *before_present(struct swapchain_data *swapchain_data,
-                                           struct queue_data *present_queue,
-                                           const VkSemaphore *wait_semaphores,
-                                           unsigned n_wait_semaphores,
-                                           unsigned imageIndex)
+static void set_compile_stats(struct swapchain_stats *sw_stats,
+                              const struct compile_stats& stats)
 {
-   struct overlay_draw *draw = NULL;
+   /* The counters are taken one by one, a concurrent creation may be split */
+   sw_stats->n_compiles = stats.n_pipelines > stats.n_cache_hits ?
+      stats.n_pipelines - stats.n_cache_hits : 0;
+   sw_stats->n_cache_hits = stats.n_cache_hits;
+   sw_stats->compile_time = stats.compile_time;
+   sw_stats->total_compiles += sw_stats->n_compiles;
+   sw_stats->total_cache_hits += stats.n_cache_hits;
+}
 
+/* Submission stats of the frame since the swapchain's last present */
+static void set_submit_stats(struct swapchain_data *data,
+                             const uint64_t counters[SUBMIT_COUNTER_MAX])
+{
+   uint64_t frame[SUBMIT_COUNTER_MAX];
+   for (unsigned c = 0; c < SUBMIT_COUNTER_MAX; c++) {
+      frame[c] = counters[c] - data->last_submit_counters[c];
+      data->last_submit_counters[c] = counters[c];
+   }
+
+   struct swapchain_stats& sw_stats = data->sw_stats;
+   sw_stats.n_submits = frame[SUBMIT_COUNTER_submits];
+   sw_stats.n_submit_batches = frame[SUBMIT_COUNTER_batches];
+   sw_stats.n_command_buffers = frame[SUBMIT_COUNTER_command_buffers];
+   sw_stats.driver_time = (frame[SUBMIT_COUNTER_submit_time] +
+                           frame[SUBMIT_COUNTER_present_time]) / 1000;
+   sw_stats.n_draws = frame[SUBMIT_COUNTER_draws + DRAW_COUNTER_draws];
+   sw_stats.n_dispatches = frame[SUBMIT_COUNTER_draws + DRAW_COUNTER_dispatches];
+   sw_stats.n_pipeline_binds = frame[SUBMIT_COUNTER_draws + DRAW_COUNTER_pipeline_binds];
+   sw_stats.n_descriptor_binds = frame[SUBMIT_COUNTER_draws + DRAW_COUNTER_descriptor_binds];
+}
+
+/* GPU waits of the frame since the swapchain's last present. The
+ * presenting thread is taken as the render thread.
+ */
+static void set_wait_stats(struct swapchain_data *data)
+{
+   thread_counters<WAIT_COUNTER_MAX>& counters = data->device->wait_counters;
+   uint64_t frame[WAIT_COUNTER_MAX];
+   for (unsigned c = 0; c < WAIT_COUNTER_MAX; c++) {
+      uint64_t total = counters.sum(c);
+      frame[c] = total - data->last_wait_counters[c];
+      data->last_wait_counters[c] = total;
+   }
+
+   struct swapchain_stats& sw_stats = data->sw_stats;
+   sw_stats.n_gpu_waits = frame[WAIT_COUNTER_waits];
+   sw_stats.gpu_wait_time = frame[WAIT_COUNTER_wait_time] / 1000;
+   sw_stats.render_thread_wait = thread_wait_ns > data->last_thread_wait ?
+      (thread_wait_ns - data->last_thread_wait) / 1000 : 0;
+   data->last_thread_wait = thread_wait_ns;
+}
+
+/* Render-ahead limiter for max_frames_ahead. Every present is followed by
+ * an empty submit to the present queue signaling its timeline, which
+ * completes with the work queued before it, and the application is then
+ * held until at most max_frames_ahead frames are left in flight. This
+ * keeps the next frame from sampling input while older ones are still
+ * queued. Returns the us the application was held.
+ */
+static uint64_t limit_frames_ahead(struct queue_data *present_queue)
+{
+   struct device_data *device_data = present_queue->device;
+   uint64_t max_frames = device_data->instance->params.max_frames_ahead;
+   std::pair<VkSemaphore, uint64_t> oldest = { VK_NULL_HANDLE, 0 };
+
+   {
+      /* Values signaled on a timeline must increase in submission order */
+      scoped_lock lk(device_data->frames_ahead_lock);
+      uint64_t value = ++present_queue->frames_ahead_value;
+
+      VkTimelineSemaphoreSubmitInfoKHR timeline_info = {};
+      timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR;
+      timeline_info.signalSemaphoreValueCount = 1;
+      timeline_info.pSignalSemaphoreValues = &value;
+
+      VkSubmitInfo submit_info = {};
+      submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+      submit_info.pNext = &timeline_info;
+      submit_info.signalSemaphoreCount = 1;
+      submit_info.pSignalSemaphores = &present_queue->frames_ahead_timeline;
+      VK_CHECK(device_data->vtable.QueueSubmit(present_queue->queue, 1,
+                                               &submit_info, VK_NULL_HANDLE));
+
+      auto& in_flight = device_data->frames_in_flight;
+      in_flight.emplace_back(present_queue->frames_ahead_timeline, value);
+      while (in_flight.size() > max_frames) {
+         oldest = in_flight.front();
+         in_flight.pop_front();
+      }
+   }
+
+   if (oldest.first == VK_NULL_HANDLE)
+      return 0;
+
+   uint64_t wait_start = os_time_get();
+   VkSemaphoreWaitInfoKHR wait_info = {};
+   wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO_KHR;
+   wait_info.semaphoreCount = 1;
+   wait_info.pSemaphores = &oldest.first;
+   wait_info.pValues = &oldest.second;
+   VK_CHECK(device_data->vtable.WaitSemaphoresKHR(device_data->device,
+                                                  &wait_info, UINT64_MAX));
+   return os_time_get() - wait_start;
+}
+
+/* Frame pacing through VK_GOOGLE_display_timing for display_timing.
+ *
+ * FpsLimiter only spaces out the presents on the CPU, the display still
+ * shows them on whichever refresh they make it to. Here each present asks
+ * for a refresh a whole number of refresh cycles after the previous one,
+ * so frames are shown at even intervals. With fps_limit that interval is
+ * rounded up to a multiple of the refresh cycle; the presents queuing up
+ * then throttle the application to it. Times are CLOCK_MONOTONIC, like
+ * os_time_get_nano(), in ns.
+ */
+static void setup_display_timing(struct swapchain_data *data)
+{
+   struct device_data *device_data = data->device;
+   VkRefreshCycleDurationGOOGLE refresh = {};
+   VK_CHECK(device_data->vtable.GetRefreshCycleDurationGOOGLE(device_data->device,
+                                                              data->swapchain,
+                                                              &refresh));
+   data->refresh_duration = refresh.refreshDuration;
+}
+
+/* desiredPresentTime of the swapchain's next present */
+static uint64_t pace_present(struct swapchain_data *data)
+{
+   const uint64_t refresh = data->refresh_duration;
+   int64_t frame_time = fps_limit_stats.targetFrameTime;
+   uint64_t cycles = 1;
+   if (frame_time > 0) {
+      /* Some slack so a limit matching a refresh multiple rounds down to it */
+      frame_time -= refresh / 16;
+      cycles = std::max<uint64_t>(1, (frame_time + refresh - 1) / refresh);
+   }
+
+   uint64_t now = os_time_get_nano();
+   uint64_t target = data->last_target_refresh + cycles * refresh;
+   if (!data->last_target_refresh || target < now + refresh / 2) {
+      /* First frame or fell behind, restart the cadence at the next
+       * refresh, found from the last one the display reported.
+       */
+      uint64_t base = data->last_actual_present;
+      if (!base || base > now)
+         base = now;
+      target = base + ((now + refresh / 2 - base) / refresh + 1) * refresh;
+   }
+   data->last_target_refresh = target;
+
+   /* Presents are not shown before the requested time, ask for half a
+    * cycle early so small errors still land on the targeted refresh.
+    */
+   return target - refresh / 2;
+}
+
+/* Reads back the presents the display reported since the last call */
+static void read_display_timing(struct swapchain_data *data)
+{
+   struct device_data *device_data = data->device;
+   uint32_t n_timings = 0;
+   VK_CHECK(device_data->vtable.GetPastPresentationTimingGOOGLE(device_data->device,
+                                                                data->swapchain,
+                                                                &n_timings, NULL));
+   if (!n_timings)
+      return;
+
+   data->past_timings.resize(n_timings);
+   device_data->vtable.GetPastPresentationTimingGOOGLE(device_data->device,
+                                                       data->swapchain, &n_timings,
+                                                       data->past_timings.data());
+
+   struct swapchain_stats& sw_stats = data->sw_stats;
+   for (uint32_t i = 0; i < n_timings; i++) {
+      const VkPastPresentationTimingGOOGLE& timing = data->past_timings[i];
+      if (data->last_actual_present)
+         sw_stats.display_interval = (timing.actualPresentTime - data->last_actual_present) / 1000;
+      data->last_actual_present = timing.actualPresentTime;
+      if (timing.desiredPresentTime) {
+         uint64_t target = timing.desiredPresentTime + data->refresh_duration / 2;
+         sw_stats.present_error = ((int64_t)timing.actualPresentTime - (int64_t)target) / 1000;
+      }
+   }
+}
+
+/* Present-to-completion latency through VK_KHR_present_id/present_wait.
+ * Presents are tagged with increasing ids and a thread per swapchain waits
+ * for them. The swapchain must be externally synchronized between
+ * vkWaitForPresentKHR, present and acquire, so the thread doesn't block in
+ * the driver while holding 'lock': it polls with a zero timeout instead,
+ * and sleeps until the next present when nothing is pending. Acquire
+ * likewise only tries under the lock, a blocking retry is done outside of
+ * it with 'acquiring' set to keep the thread off the swapchain.
+ */
+#define PRESENT_WAIT_POLL_US 250
+
+struct present_waiter {
+   struct swapchain_data *swapchain;
+   std::thread thread;
+   std::atomic<bool> quit;
+
+   std::mutex lock; /* held around every call using the swapchain */
+   bool acquiring;  /* under lock, an acquire is blocking outside of it */
+   std::condition_variable wake; /* on new pending presents and quit */
+   struct pending_present {
+      uint64_t id;
+      uint64_t time; /* us, when it was handed to the driver */
+   };
+   std::deque<struct pending_present> pending;
+   uint64_t last_id; /* of the layer's own ids */
+
+   std::atomic<uint64_t> latency; /* us, of the last completed present */
+};
+
+#ifdef VK_KHR_present_wait
+static void present_waiter_thread(struct present_waiter *waiter)
+{
+   struct device_data *device_data = waiter->swapchain->device;
+   std::unique_lock<std::mutex> lk(waiter->lock);
+
+   while (!waiter->quit) {
+      if (waiter->pending.empty()) {
+         waiter->wake.wait(lk);
+         continue;
+      }
+
+      while (!waiter->pending.empty() && !waiter->acquiring) {
+         auto& present = waiter->pending.front();
+         VkResult result =
+            device_data->vtable.WaitForPresentKHR(device_data->device,
+                                                  waiter->swapchain->swapchain,
+                                                  present.id, 0);
+         if (result == VK_TIMEOUT)
+            break;
+         /* Out of date or lost presents are dropped */
+         if (result == VK_SUCCESS || result == VK_SUBOPTIMAL_KHR)
+            waiter->latency = os_time_get() - present.time;
+         waiter->pending.pop_front();
+      }
+
+      if (!waiter->pending.empty()) {
+         lk.unlock();
+         std::this_thread::sleep_for(std::chrono::microseconds(PRESENT_WAIT_POLL_US));
+         lk.lock();
+      }
+   }
+}
+#endif
+
+static void start_present_waiter(struct swapchain_data *data)
+{
+#ifdef VK_KHR_present_wait
+   if (!data->device->present_wait)
+      return;
+
+   struct present_waiter *waiter = new present_waiter();
+   waiter->swapchain = data;
+   waiter->quit = false;
+   waiter->acquiring = false;
+   waiter->latency = 0;
+   waiter->thread = std::thread(present_waiter_thread, waiter);
+   data->present_waiter = waiter;
+#endif
+}
+
+static void stop_present_waiter(struct swapchain_data *data)
+{
+   struct present_waiter *waiter = data->present_waiter;
+   if (!waiter)
+      return;
+
+   {
+      /* Under the lock so the thread can't miss it before waiting */
+      scoped_lock lk(waiter->lock);
+      waiter->quit = true;
+   }
+   waiter->wake.notify_one();
+   waiter->thread.join();
+   delete waiter;
+   data->present_waiter = NULL;
+}
+
+static void before_present(struct swapchain_data *swapchain_data,
+                           struct queue_data *present_queue,
+                           unsigned imageIndex)
+{
    snapshot_swapchain_frame(swapchain_data);
 
    if (swapchain_data->sw_stats.n_frames > 0) {
-      compute_swapchain_display(swapchain_data);
-      draw = render_swapchain_display(swapchain_data, present_queue,
-                                      wait_semaphores, n_wait_semaphores,
-                                      imageIndex);
+      /* Rendered offscreen the HUD is only laid out again at
+       * hud_refresh_rate, other frames reuse the last draw data.
+       */
+      bool self_overhead = swapchain_data->device->instance->params.self_overhead;
+      swapchain_data->layout_cpu_time = 0;
+      if (!hud_offscreen(swapchain_data) ||
+          hud_refresh_due(swapchain_data->device->instance->params,
+                          swapchain_data->hud.last_refresh)) {
+         uint64_t layout_start = self_overhead ? thread_cpu_time() : 0;
+         compute_swapchain_display(swapchain_data);
+         swapchain_data->hud.dirty = true;
+         if (self_overhead)
+            swapchain_data->layout_cpu_time = thread_cpu_time() - layout_start;
+      }
+      render_swapchain_display(swapchain_data, present_queue, imageIndex);
    }
-
-   return draw;
 }
 
 static VkResult overlay_CreateSwapchainKHR(
@@ -2352,8 +4484,19 @@ static VkResult overlay_CreateSwapchainKHR(
 
    VkResult result = device_data->vtable.CreateSwapchainKHR(device, pCreateInfo, pAllocator, pSwapchain);
    if (result != VK_SUCCESS) return result;
+#ifndef NDEBUG
+   uint64_t setup_start = os_time_get();
+#endif
+   device_data->has_swapchain = true;
    struct swapchain_data *swapchain_data = new_swapchain_data(*pSwapchain, device_data);
    setup_swapchain_data(swapchain_data, pCreateInfo, device_data->instance->params);
+   start_present_waiter(swapchain_data);
+   if (device_data->display_timing)
+      setup_display_timing(swapchain_data);
+#ifndef NDEBUG
+   std::cerr << "MANGOHUD: swapchain overlay set up in "
+             << os_time_get() - setup_start << " us\n";
+#endif
 
    const VkPhysicalDeviceProperties& prop = device_data->properties;
    swapchain_data->sw_stats.version_vk.major = VK_VERSION_MAJOR(prop.apiVersion);
@@ -2393,6 +4536,7 @@ static void overlay_DestroySwapchainKHR(
    struct swapchain_data *swapchain_data =
       FIND(struct swapchain_data, swapchain);
 
+   stop_present_waiter(swapchain_data);
    shutdown_swapchain_data(swapchain_data);
    swapchain_data->device->vtable.DestroySwapchainKHR(device, swapchain, pAllocator);
    destroy_swapchain_data(swapchain_data);
@@ -2414,45 +4558,170 @@ static VkResult overlay_QueuePresentKHR(
     const VkPresentInfoKHR*                     pPresentInfo)
 {
    struct queue_data *queue_data = FIND(struct queue_data, queue);
+   struct overlay_batch *batch = &queue_data->batch;
+   bool self_overhead = queue_data->device->instance->params.self_overhead;
+   uint64_t overhead_start = self_overhead ? thread_cpu_time() : 0;
+
+   batch->swapchains.clear();
+   batch->draws.clear();
+   batch->n_command_buffers.clear();
+   batch->command_buffers.clear();
+
+   struct queue_data *timed_queue = queue_data->device->graphic_queue;
+   uint64_t gpu_frametime = 0;
+   if (timed_queue && timed_queue->gpu_timer)
+      gpu_frametime = gpu_timer_present(timed_queue);
+   struct compile_stats compile_stats = take_compile_stats(queue_data->device);
+   uint64_t submit_counters[SUBMIT_COUNTER_MAX] = {};
+   bool submit_counted = queue_data->device->instance->params.submit_stats ||
+                         (queue_data->device->hooks & OVERLAY_HOOKS_DRAW);
+   if (submit_counted) {
+      for (unsigned c = 0; c < SUBMIT_COUNTER_MAX; c++)
+         submit_counters[c] = queue_data->device->submit_counters.sum(c);
+   }
 
-   /* Otherwise we need to add our overlay drawing semaphore to the list of
-    * semaphores to wait on. If we don't do that the presented picture might
-    * be have incomplete overlay drawings.
-    */
-   VkResult result = VK_SUCCESS;
    for (uint32_t i = 0; i < pPresentInfo->swapchainCount; i++) {
-      VkSwapchainKHR swapchain = pPresentInfo->pSwapchains[i];
       struct swapchain_data *swapchain_data =
-         FIND(struct swapchain_data, swapchain);
+         FIND(struct swapchain_data, pPresentInfo->pSwapchains[i]);
+      /* Nothing left to draw with, the frame counts for the new swapchain */
+      if (swapchain_data->retired)
+         continue;
+      swapchain_data->sw_stats.gpu_frametime = gpu_frametime;
+      if (swapchain_data->present_waiter)
+         swapchain_data->sw_stats.present_latency = swapchain_data->present_waiter->latency;
+      set_compile_stats(&swapchain_data->sw_stats, compile_stats);
+      if (submit_counted)
+         set_submit_stats(swapchain_data, submit_counters);
+      if (queue_data->device->hooks & OVERLAY_HOOKS_WAIT)
+         set_wait_stats(swapchain_data);
+      if (queue_data->device->hooks & OVERLAY_HOOKS_MEMORY)
+         update_memory_stats(swapchain_data);
+      if (swapchain_data->refresh_duration) {
+         swapchain_data->sw_stats.display_timing = true;
+         read_display_timing(swapchain_data);
+      }
+      if (queue_data->device->frames_ahead) {
+         swapchain_data->sw_stats.max_frames_ahead =
+            queue_data->device->instance->params.max_frames_ahead;
+         swapchain_data->sw_stats.frames_ahead_wait =
+            swapchain_data->frames_ahead_wait.exchange(0);
+      }
+      if (queue_data->device->hooks & OVERLAY_HOOKS_ACQUIRE) {
+         swapchain_data->sw_stats.present_wait_tracked = true;
+         swapchain_data->sw_stats.present_wait = swapchain_data->present_wait.exchange(0);
+      }
+      if (self_overhead)
+         set_overhead_stats(swapchain_data);
+      before_present(swapchain_data, queue_data, pPresentInfo->pImageIndices[i]);
+   }
+
+   /* Because the submission of the overlay draws waits on the semaphores
+    * handed for present, we don't need to have this present operation
+    * wait on them as well, we can just wait on the overlay submission
+    * semaphore. The present itself stays a single call with the
+    * application's swapchains.
+    */
+   VkPresentInfoKHR present_info = *pPresentInfo;
+   VkSemaphore semaphore = submit_overlay_batch(queue_data,
+                                                pPresentInfo->pWaitSemaphores,
+                                                pPresentInfo->waitSemaphoreCount);
+   if (semaphore != VK_NULL_HANDLE) {
+      present_info.pWaitSemaphores = &semaphore;
+      present_info.waitSemaphoreCount = 1;
+   }
+
+#ifdef VK_KHR_present_wait
+   /* Tag the presents for the waiters unless the application brings its
+    * own ids, which are then tracked instead.
+    */
+   VkPresentIdKHR present_id = {};
+   if (queue_data->device->present_wait) {
+      const VkPresentIdKHR *app_ids = (const VkPresentIdKHR *)
+         vk_find_struct_const(pPresentInfo->pNext, PRESENT_ID_KHR);
+
+      batch->present_ids.resize(pPresentInfo->swapchainCount);
+      for (uint32_t i = 0; i < pPresentInfo->swapchainCount; i++) {
+         struct present_waiter *waiter =
+            FIND(struct swapchain_data, pPresentInfo->pSwapchains[i])->present_waiter;
+         if (app_ids)
+            batch->present_ids[i] = app_ids->pPresentIds ? app_ids->pPresentIds[i] : 0;
+         else
+            batch->present_ids[i] = ++waiter->last_id;
+         waiter->lock.lock();
+      }
 
-      uint32_t image_index = pPresentInfo->pImageIndices[i];
+      if (!app_ids) {
+         present_id.sType = VK_STRUCTURE_TYPE_PRESENT_ID_KHR;
+         present_id.pNext = present_info.pNext;
+         present_id.swapchainCount = pPresentInfo->swapchainCount;
+         present_id.pPresentIds = batch->present_ids.data();
+         present_info.pNext = &present_id;
+      }
+   }
+#endif
+
+   /* Left alone when the application paces its presents itself */
+   VkPresentTimesInfoGOOGLE present_times = {};
+   if (queue_data->device->display_timing &&
+       !vk_find_struct_const(pPresentInfo->pNext, PRESENT_TIMES_INFO_GOOGLE)) {
+      batch->present_times.resize(pPresentInfo->swapchainCount);
+      for (uint32_t i = 0; i < pPresentInfo->swapchainCount; i++) {
+         struct swapchain_data *swapchain_data =
+            FIND(struct swapchain_data, pPresentInfo->pSwapchains[i]);
+         VkPresentTimeGOOGLE& time = batch->present_times[i];
+         time.presentID = 0;
+         time.desiredPresentTime = 0;
+         if (swapchain_data->refresh_duration) {
+            time.presentID = ++swapchain_data->last_timing_id;
+            time.desiredPresentTime = pace_present(swapchain_data);
+         }
+      }
+
+      present_times.sType = VK_STRUCTURE_TYPE_PRESENT_TIMES_INFO_GOOGLE;
+      present_times.pNext = present_info.pNext;
+      present_times.swapchainCount = pPresentInfo->swapchainCount;
+      present_times.pTimes = batch->present_times.data();
+      present_info.pNext = &present_times;
+   }
+
+   /* Everything the layer did for this present, overlay submission
+    * included, shown with the next frame.
+    */
+   if (self_overhead) {
+      uint64_t layer_cpu_time = thread_cpu_time() - overhead_start;
+      for (uint32_t i = 0; i < pPresentInfo->swapchainCount; i++)
+         FIND(struct swapchain_data, pPresentInfo->pSwapchains[i])->layer_cpu_time = layer_cpu_time;
+   }
+
+   uint64_t present_time = os_time_get();
+   uint64_t present_start = os_time_get_nano();
 
-      VkPresentInfoKHR present_info = *pPresentInfo;
-      present_info.swapchainCount = 1;
-      present_info.pSwapchains = &swapchain;
-      present_info.pImageIndices = &image_index;
+   VkResult result = queue_data->device->vtable.QueuePresentKHR(queue, &present_info);
 
-      struct overlay_draw *draw = before_present(swapchain_data,
-                                                   queue_data,
-                                                   pPresentInfo->pWaitSemaphores,
-                                                   pPresentInfo->waitSemaphoreCount,
-                                                   image_index);
+   if (queue_data->device->instance->params.submit_stats) {
+      queue_data->device->submit_counters.add(SUBMIT_COUNTER_present_time,
+                                              os_time_get_nano() - present_start);
+   }
 
-      /* Because the submission of the overlay draw waits on the semaphores
-         * handed for present, we don't need to have this present operation
-         * wait on them as well, we can just wait on the overlay submission
-         * semaphore.
-         */
-      if (draw) {
-         present_info.pWaitSemaphores = &draw->semaphore;
-         present_info.waitSemaphoreCount = 1;
+#ifdef VK_KHR_present_wait
+   if (queue_data->device->present_wait) {
+      for (uint32_t i = 0; i < pPresentInfo->swapchainCount; i++) {
+         struct present_waiter *waiter =
+            FIND(struct swapchain_data, pPresentInfo->pSwapchains[i])->present_waiter;
+         VkResult swapchain_result = pPresentInfo->pResults ? pPresentInfo->pResults[i] : result;
+         if (batch->present_ids[i] &&
+             (swapchain_result == VK_SUCCESS || swapchain_result == VK_SUBOPTIMAL_KHR))
+            waiter->pending.push_back({ batch->present_ids[i], present_time });
+         waiter->lock.unlock();
+         waiter->wake.notify_one();
       }
+   }
+#endif
 
-      VkResult chain_result = queue_data->device->vtable.QueuePresentKHR(queue, &present_info);
-      if (pPresentInfo->pResults)
-         pPresentInfo->pResults[i] = chain_result;
-      if (chain_result != VK_SUCCESS && result == VK_SUCCESS)
-         result = chain_result;
+   if (queue_data->device->frames_ahead) {
+      uint64_t held = limit_frames_ahead(queue_data);
+      for (uint32_t i = 0; i < pPresentInfo->swapchainCount; i++)
+         FIND(struct swapchain_data, pPresentInfo->pSwapchains[i])->frames_ahead_wait += held;
    }
 
    if (fps_limit_stats.targetFrameTime > 0){
@@ -2460,7 +4729,333 @@ static VkResult overlay_QueuePresentKHR(
       FpsLimiter(fps_limit_stats);
       fps_limit_stats.frameEnd = os_time_get_nano();
    }
-   
+
+   /* Blocking in the driver's present, max_frames_ahead or fps_limit
+    * counts against the next frame of each swapchain.
+    */
+   if (queue_data->device->hooks & OVERLAY_HOOKS_ACQUIRE) {
+      uint64_t blocked = os_time_get() - present_time;
+      for (uint32_t i = 0; i < pPresentInfo->swapchainCount; i++)
+         FIND(struct swapchain_data, pPresentInfo->pSwapchains[i])->present_wait += blocked;
+   }
+
+   return result;
+}
+
+static VkResult overlay_AcquireNextImageKHR(
+    VkDevice                                    device,
+    VkSwapchainKHR                              swapchain,
+    uint64_t                                    timeout,
+    VkSemaphore                                 semaphore,
+    VkFence                                     fence,
+    uint32_t*                                   pImageIndex)
+{
+   struct swapchain_data *swapchain_data = FIND(struct swapchain_data, swapchain);
+   struct device_data *device_data = swapchain_data->device;
+   struct present_waiter *waiter = swapchain_data->present_waiter;
+
+   uint64_t start = os_time_get();
+   VkResult result;
+   if (!waiter) {
+      result = device_data->vtable.AcquireNextImageKHR(device, swapchain, timeout,
+                                                       semaphore, fence, pImageIndex);
+   } else {
+      /* Keeps the present waiter off the swapchain while acquiring. Only
+       * an attempt that can't block is made under its lock.
+       */
+      bool retry;
+      {
+         scoped_lock lk(waiter->lock);
+         result = device_data->vtable.AcquireNextImageKHR(device, swapchain, 0,
+                                                          semaphore, fence, pImageIndex);
+         retry = timeout && (result == VK_NOT_READY || result == VK_TIMEOUT);
+         waiter->acquiring = retry;
+      }
+      if (retry) {
+         result = device_data->vtable.AcquireNextImageKHR(device, swapchain, timeout,
+                                                          semaphore, fence, pImageIndex);
+         scoped_lock lk(waiter->lock);
+         waiter->acquiring = false;
+      }
+   }
+   swapchain_data->present_wait += os_time_get() - start;
+   return result;
+}
+
+static VkResult overlay_AcquireNextImage2KHR(
+    VkDevice                                    device,
+    const VkAcquireNextImageInfoKHR*            pAcquireInfo,
+    uint32_t*                                   pImageIndex)
+{
+   struct swapchain_data *swapchain_data =
+      FIND(struct swapchain_data, pAcquireInfo->swapchain);
+   struct device_data *device_data = swapchain_data->device;
+   struct present_waiter *waiter = swapchain_data->present_waiter;
+
+   uint64_t start = os_time_get();
+   VkResult result;
+   if (!waiter) {
+      result = device_data->vtable.AcquireNextImage2KHR(device, pAcquireInfo, pImageIndex);
+   } else {
+      /* As in overlay_AcquireNextImageKHR() */
+      VkAcquireNextImageInfoKHR try_info = *pAcquireInfo;
+      try_info.timeout = 0;
+      bool retry;
+      {
+         scoped_lock lk(waiter->lock);
+         result = device_data->vtable.AcquireNextImage2KHR(device, &try_info, pImageIndex);
+         retry = pAcquireInfo->timeout && (result == VK_NOT_READY || result == VK_TIMEOUT);
+         waiter->acquiring = retry;
+      }
+      if (retry) {
+         result = device_data->vtable.AcquireNextImage2KHR(device, pAcquireInfo, pImageIndex);
+         scoped_lock lk(waiter->lock);
+         waiter->acquiring = false;
+      }
+   }
+   swapchain_data->present_wait += os_time_get() - start;
+   return result;
+}
+
+static VkResult overlay_AllocateMemory(
+    VkDevice                                    device,
+    const VkMemoryAllocateInfo*                 pAllocateInfo,
+    const VkAllocationCallbacks*                pAllocator,
+    VkDeviceMemory*                             pMemory)
+{
+   struct device_data *device_data = FIND(struct device_data, device);
+
+   VkResult result = device_data->vtable.AllocateMemory(device, pAllocateInfo,
+                                                        pAllocator, pMemory);
+   if (result != VK_SUCCESS)
+      return result;
+
+   struct device_memory_data *data = new device_memory_data();
+   data->device = device_data;
+   data->heap_index =
+      device_data->memory_properties.memoryTypes[pAllocateInfo->memoryTypeIndex].heapIndex;
+   data->size = pAllocateInfo->allocationSize;
+   map_object(HKEY(*pMemory), data);
+
+   device_data->heap_allocated[data->heap_index] += data->size;
+   device_data->n_allocations++;
+   return result;
+}
+
+static void overlay_FreeMemory(
+    VkDevice                                    device,
+    VkDeviceMemory                              memory,
+    const VkAllocationCallbacks*                pAllocator)
+{
+   struct device_data *device_data = FIND(struct device_data, device);
+
+   struct device_memory_data *data = FIND(struct device_memory_data, memory);
+   if (data) {
+      device_data->heap_allocated[data->heap_index] -= data->size;
+      unmap_object(HKEY(memory));
+      delete data;
+   }
+
+   device_data->vtable.FreeMemory(device, memory, pAllocator);
+}
+
+/* Samples the process_vram stats once per fps_sampling_period */
+static void update_memory_stats(struct swapchain_data *data)
+{
+   struct device_data *device_data = data->device;
+   struct swapchain_stats& sw_stats = data->sw_stats;
+   const struct overlay_params& params = device_data->instance->params;
+
+   uint64_t now = os_time_get(); /* us */
+   uint64_t elapsed = now - sw_stats.last_memory_update;
+   if (sw_stats.last_memory_update && elapsed < params.fps_sampling_period)
+      return;
+
+   uint64_t n_allocations = device_data->n_allocations;
+   if (sw_stats.last_memory_update) {
+      sw_stats.allocations_per_sec =
+         (n_allocations - sw_stats.last_n_allocations) * 1000000.0 / elapsed;
+   }
+   sw_stats.last_n_allocations = n_allocations;
+   sw_stats.last_memory_update = now;
+
+   const VkPhysicalDeviceMemoryProperties& props = device_data->memory_properties;
+   sw_stats.process_vram = 0;
+   for (uint32_t i = 0; i < props.memoryHeapCount; i++) {
+      if (props.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)
+         sw_stats.process_vram += device_data->heap_allocated[i];
+   }
+
+   if (!device_data->get_memory_properties2)
+      return;
+
+   /* Usage and budget of the process, pressure is that of the fullest
+    * device local heap.
+    */
+   VkPhysicalDeviceMemoryBudgetPropertiesEXT budget = {};
+   budget.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT;
+   VkPhysicalDeviceMemoryProperties2 props2 = {};
+   props2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2;
+   props2.pNext = &budget;
+   device_data->get_memory_properties2(device_data->physical_device, &props2);
+
+   sw_stats.vram_usage = sw_stats.vram_budget = 0;
+   sw_stats.heap_pressure = 0.0f;
+   for (uint32_t i = 0; i < props2.memoryProperties.memoryHeapCount; i++) {
+      if (!(props2.memoryProperties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) ||
+          !budget.heapBudget[i])
+         continue;
+      sw_stats.vram_usage += budget.heapUsage[i];
+      sw_stats.vram_budget += budget.heapBudget[i];
+      sw_stats.heap_pressure = std::max(sw_stats.heap_pressure,
+                                        (float)budget.heapUsage[i] / budget.heapBudget[i]);
+   }
+}
+
+/* Stats of the application's pipeline creation for compile_stats. With
+ * VK_EXT_pipeline_creation_feedback each pipeline reports whether it came
+ * out of the application's pipeline cache; feedback structs are chained in
+ * unless the application brings its own, which are read instead.
+ */
+struct pipeline_feedback {
+   std::vector<VkPipelineCreationFeedbackCreateInfoEXT> create_infos;
+   std::vector<VkPipelineCreationFeedbackEXT> pipelines;
+   std::vector<VkPipelineCreationFeedbackEXT> stages;
+   std::vector<const VkPipelineCreationFeedbackEXT *> results; /* per pipeline */
+};
+
+static uint32_t pipeline_stage_count(const VkGraphicsPipelineCreateInfo& info)
+{
+   return info.stageCount;
+}
+
+static uint32_t pipeline_stage_count(const VkComputePipelineCreateInfo& info)
+{
+   return 1;
+}
+
+template <typename CreateInfo>
+static const CreateInfo *chain_pipeline_feedback(struct pipeline_feedback *feedback,
+                                                 std::vector<CreateInfo>& infos,
+                                                 uint32_t count,
+                                                 const CreateInfo *pCreateInfos)
+{
+   infos.assign(pCreateInfos, pCreateInfos + count);
+   feedback->create_infos.resize(count);
+   feedback->pipelines.resize(count);
+   feedback->results.resize(count);
+
+   uint32_t n_stages = 0;
+   for (auto& info : infos)
+      n_stages += pipeline_stage_count(info);
+   feedback->stages.resize(n_stages);
+
+   n_stages = 0;
+   for (uint32_t i = 0; i < count; i++) {
+      const VkPipelineCreationFeedbackCreateInfoEXT *app_feedback =
+         (const VkPipelineCreationFeedbackCreateInfoEXT *)
+         vk_find_struct_const(infos[i].pNext, PIPELINE_CREATION_FEEDBACK_CREATE_INFO_EXT);
+      if (app_feedback) {
+         feedback->results[i] = app_feedback->pPipelineCreationFeedback;
+         continue;
+      }
+
+      VkPipelineCreationFeedbackCreateInfoEXT *create_info = &feedback->create_infos[i];
+      *create_info = {};
+      create_info->sType = VK_STRUCTURE_TYPE_PIPELINE_CREATION_FEEDBACK_CREATE_INFO_EXT;
+      create_info->pNext = infos[i].pNext;
+      create_info->pPipelineCreationFeedback = &feedback->pipelines[i];
+      create_info->pipelineStageCreationFeedbackCount = pipeline_stage_count(infos[i]);
+      create_info->pPipelineStageCreationFeedbacks = &feedback->stages[n_stages];
+      n_stages += create_info->pipelineStageCreationFeedbackCount;
+      infos[i].pNext = create_info;
+      feedback->results[i] = &feedback->pipelines[i];
+   }
+   return infos.data();
+}
+
+static void account_pipelines(struct device_data *device_data,
+                              uint64_t start,
+                              uint32_t count,
+                              const VkPipeline *pPipelines,
+                              const struct pipeline_feedback *feedback)
+{
+   uint32_t n_pipelines = 0, n_cache_hits = 0;
+   for (uint32_t i = 0; i < count; i++) {
+      if (pPipelines[i] == VK_NULL_HANDLE)
+         continue;
+      n_pipelines++;
+
+      const VkPipelineCreationFeedbackEXT *result =
+         feedback->results.empty() ? NULL : feedback->results[i];
+      if (result && (result->flags & VK_PIPELINE_CREATION_FEEDBACK_VALID_BIT_EXT) &&
+          (result->flags & VK_PIPELINE_CREATION_FEEDBACK_APPLICATION_PIPELINE_CACHE_HIT_BIT_EXT))
+         n_cache_hits++;
+   }
+
+   device_data->compile_time += os_time_get() - start;
+   device_data->n_pipelines += n_pipelines;
+   device_data->n_cache_hits += n_cache_hits;
+}
+
+static VkResult overlay_CreateGraphicsPipelines(
+    VkDevice                                    device,
+    VkPipelineCache                             pipelineCache,
+    uint32_t                                    createInfoCount,
+    const VkGraphicsPipelineCreateInfo*         pCreateInfos,
+    const VkAllocationCallbacks*                pAllocator,
+    VkPipeline*                                 pPipelines)
+{
+   struct device_data *device_data = FIND(struct device_data, device);
+
+   struct pipeline_feedback feedback;
+   std::vector<VkGraphicsPipelineCreateInfo> infos;
+   if (device_data->pipeline_feedback)
+      pCreateInfos = chain_pipeline_feedback(&feedback, infos, createInfoCount, pCreateInfos);
+
+   uint64_t start = os_time_get();
+   VkResult result = device_data->vtable.CreateGraphicsPipelines(device, pipelineCache,
+                                                                 createInfoCount, pCreateInfos,
+                                                                 pAllocator, pPipelines);
+   account_pipelines(device_data, start, createInfoCount, pPipelines, &feedback);
+   return result;
+}
+
+static VkResult overlay_CreateComputePipelines(
+    VkDevice                                    device,
+    VkPipelineCache                             pipelineCache,
+    uint32_t                                    createInfoCount,
+    const VkComputePipelineCreateInfo*          pCreateInfos,
+    const VkAllocationCallbacks*                pAllocator,
+    VkPipeline*                                 pPipelines)
+{
+   struct device_data *device_data = FIND(struct device_data, device);
+
+   struct pipeline_feedback feedback;
+   std::vector<VkComputePipelineCreateInfo> infos;
+   if (device_data->pipeline_feedback)
+      pCreateInfos = chain_pipeline_feedback(&feedback, infos, createInfoCount, pCreateInfos);
+
+   uint64_t start = os_time_get();
+   VkResult result = device_data->vtable.CreateComputePipelines(device, pipelineCache,
+                                                                createInfoCount, pCreateInfos,
+                                                                pAllocator, pPipelines);
+   account_pipelines(device_data, start, createInfoCount, pPipelines, &feedback);
+   return result;
+}
+
+static VkResult overlay_CreateShaderModule(
+    VkDevice                                    device,
+    const VkShaderModuleCreateInfo*             pCreateInfo,
+    const VkAllocationCallbacks*                pAllocator,
+    VkShaderModule*                             pShaderModule)
+{
+   struct device_data *device_data = FIND(struct device_data, device);
+
+   uint64_t start = os_time_get();
+   VkResult result = device_data->vtable.CreateShaderModule(device, pCreateInfo,
+                                                            pAllocator, pShaderModule);
+   device_data->compile_time += os_time_get() - start;
    return result;
 }
 
@@ -2472,6 +5067,8 @@ static VkResult overlay_BeginCommandBuffer(
       FIND(struct command_buffer_data, commandBuffer);
    struct device_data *device_data = cmd_buffer_data->device;
 
+   memset(cmd_buffer_data->counters, 0, sizeof(cmd_buffer_data->counters));
+
    /* Otherwise record a begin query as first command. */
    VkResult result = device_data->vtable.BeginCommandBuffer(commandBuffer, pBeginInfo);
 
@@ -2482,33 +5079,220 @@ static VkResult overlay_EndCommandBuffer(
     VkCommandBuffer                             commandBuffer)
 {
    struct command_buffer_data *cmd_buffer_data =
-      FIND(struct command_buffer_data, commandBuffer);
-   struct device_data *device_data = cmd_buffer_data->device;
-
-   return device_data->vtable.EndCommandBuffer(commandBuffer);
+      FIND(struct command_buffer_data, commandBuffer);
+   struct device_data *device_data = cmd_buffer_data->device;
+
+   return device_data->vtable.EndCommandBuffer(commandBuffer);
+}
+
+static VkResult overlay_ResetCommandBuffer(
+    VkCommandBuffer                             commandBuffer,
+    VkCommandBufferResetFlags                   flags)
+{
+   struct command_buffer_data *cmd_buffer_data =
+      FIND(struct command_buffer_data, commandBuffer);
+   struct device_data *device_data = cmd_buffer_data->device;
+
+   memset(cmd_buffer_data->counters, 0, sizeof(cmd_buffer_data->counters));
+
+   return device_data->vtable.ResetCommandBuffer(commandBuffer, flags);
+}
+
+static void overlay_CmdExecuteCommands(
+    VkCommandBuffer                             commandBuffer,
+    uint32_t                                    commandBufferCount,
+    const VkCommandBuffer*                      pCommandBuffers)
+{
+   struct command_buffer_data *cmd_buffer_data =
+      FIND(struct command_buffer_data, commandBuffer);
+   struct device_data *device_data = cmd_buffer_data->device;
+
+   /* Secondaries count as part of the primary executing them */
+   for (uint32_t i = 0; i < commandBufferCount; i++) {
+      struct command_buffer_data *secondary =
+         FIND(struct command_buffer_data, pCommandBuffers[i]);
+      if (!secondary)
+         continue;
+      for (unsigned c = 0; c < DRAW_COUNTER_MAX; c++)
+         cmd_buffer_data->counters[c] += secondary->counters[c];
+   }
+
+   device_data->vtable.CmdExecuteCommands(commandBuffer, commandBufferCount, pCommandBuffers);
+}
+
+#ifndef NDEBUG
+/* Cost of the draw_stats counting, printed at device destruction */
+static std::atomic<uint64_t> counted_commands, counted_command_ns;
+#endif
+
+/* Counts a command for draw_stats and returns the command buffer's data
+ * for the call down the chain.
+ */
+static inline struct command_buffer_data *count_command(VkCommandBuffer commandBuffer,
+                                                        enum draw_counter counter)
+{
+#ifndef NDEBUG
+   uint64_t start = os_time_get_nano();
+#endif
+   struct command_buffer_data *cmd_buffer_data =
+      FIND(struct command_buffer_data, commandBuffer);
+   cmd_buffer_data->counters[counter]++;
+#ifndef NDEBUG
+   counted_commands++;
+   counted_command_ns += os_time_get_nano() - start;
+#endif
+   return cmd_buffer_data;
+}
+
+static void overlay_CmdDraw(
+    VkCommandBuffer                             commandBuffer,
+    uint32_t                                    vertexCount,
+    uint32_t                                    instanceCount,
+    uint32_t                                    firstVertex,
+    uint32_t                                    firstInstance)
+{
+   struct command_buffer_data *cmd_buffer_data =
+      count_command(commandBuffer, DRAW_COUNTER_draws);
+   cmd_buffer_data->device->vtable.CmdDraw(commandBuffer, vertexCount, instanceCount,
+                                           firstVertex, firstInstance);
+}
+
+static void overlay_CmdDrawIndexed(
+    VkCommandBuffer                             commandBuffer,
+    uint32_t                                    indexCount,
+    uint32_t                                    instanceCount,
+    uint32_t                                    firstIndex,
+    int32_t                                     vertexOffset,
+    uint32_t                                    firstInstance)
+{
+   struct command_buffer_data *cmd_buffer_data =
+      count_command(commandBuffer, DRAW_COUNTER_draws);
+   cmd_buffer_data->device->vtable.CmdDrawIndexed(commandBuffer, indexCount, instanceCount,
+                                                  firstIndex, vertexOffset, firstInstance);
+}
+
+static void overlay_CmdDrawIndirect(
+    VkCommandBuffer                             commandBuffer,
+    VkBuffer                                    buffer,
+    VkDeviceSize                                offset,
+    uint32_t                                    drawCount,
+    uint32_t                                    stride)
+{
+   struct command_buffer_data *cmd_buffer_data =
+      count_command(commandBuffer, DRAW_COUNTER_draws);
+   cmd_buffer_data->device->vtable.CmdDrawIndirect(commandBuffer, buffer, offset,
+                                                   drawCount, stride);
+}
+
+static void overlay_CmdDrawIndexedIndirect(
+    VkCommandBuffer                             commandBuffer,
+    VkBuffer                                    buffer,
+    VkDeviceSize                                offset,
+    uint32_t                                    drawCount,
+    uint32_t                                    stride)
+{
+   struct command_buffer_data *cmd_buffer_data =
+      count_command(commandBuffer, DRAW_COUNTER_draws);
+   cmd_buffer_data->device->vtable.CmdDrawIndexedIndirect(commandBuffer, buffer, offset,
+                                                          drawCount, stride);
+}
+
+static void overlay_CmdDrawIndirectCount(
+    VkCommandBuffer                             commandBuffer,
+    VkBuffer                                    buffer,
+    VkDeviceSize                                offset,
+    VkBuffer                                    countBuffer,
+    VkDeviceSize                                countBufferOffset,
+    uint32_t                                    maxDrawCount,
+    uint32_t                                    stride)
+{
+   struct command_buffer_data *cmd_buffer_data =
+      count_command(commandBuffer, DRAW_COUNTER_draws);
+   cmd_buffer_data->device->vtable.CmdDrawIndirectCount(commandBuffer, buffer, offset,
+                                                        countBuffer, countBufferOffset,
+                                                        maxDrawCount, stride);
+}
+
+static void overlay_CmdDrawIndexedIndirectCount(
+    VkCommandBuffer                             commandBuffer,
+    VkBuffer                                    buffer,
+    VkDeviceSize                                offset,
+    VkBuffer                                    countBuffer,
+    VkDeviceSize                                countBufferOffset,
+    uint32_t                                    maxDrawCount,
+    uint32_t                                    stride)
+{
+   struct command_buffer_data *cmd_buffer_data =
+      count_command(commandBuffer, DRAW_COUNTER_draws);
+   cmd_buffer_data->device->vtable.CmdDrawIndexedIndirectCount(commandBuffer, buffer, offset,
+                                                               countBuffer, countBufferOffset,
+                                                               maxDrawCount, stride);
+}
+
+static void overlay_CmdDispatch(
+    VkCommandBuffer                             commandBuffer,
+    uint32_t                                    groupCountX,
+    uint32_t                                    groupCountY,
+    uint32_t                                    groupCountZ)
+{
+   struct command_buffer_data *cmd_buffer_data =
+      count_command(commandBuffer, DRAW_COUNTER_dispatches);
+   cmd_buffer_data->device->vtable.CmdDispatch(commandBuffer, groupCountX, groupCountY,
+                                               groupCountZ);
+}
+
+static void overlay_CmdDispatchIndirect(
+    VkCommandBuffer                             commandBuffer,
+    VkBuffer                                    buffer,
+    VkDeviceSize                                offset)
+{
+   struct command_buffer_data *cmd_buffer_data =
+      count_command(commandBuffer, DRAW_COUNTER_dispatches);
+   cmd_buffer_data->device->vtable.CmdDispatchIndirect(commandBuffer, buffer, offset);
+}
+
+static void overlay_CmdDispatchBase(
+    VkCommandBuffer                             commandBuffer,
+    uint32_t                                    baseGroupX,
+    uint32_t                                    baseGroupY,
+    uint32_t                                    baseGroupZ,
+    uint32_t                                    groupCountX,
+    uint32_t                                    groupCountY,
+    uint32_t                                    groupCountZ)
+{
+   struct command_buffer_data *cmd_buffer_data =
+      count_command(commandBuffer, DRAW_COUNTER_dispatches);
+   cmd_buffer_data->device->vtable.CmdDispatchBase(commandBuffer, baseGroupX, baseGroupY,
+                                                   baseGroupZ, groupCountX, groupCountY,
+                                                   groupCountZ);
 }
 
-static VkResult overlay_ResetCommandBuffer(
+static void overlay_CmdBindPipeline(
     VkCommandBuffer                             commandBuffer,
-    VkCommandBufferResetFlags                   flags)
+    VkPipelineBindPoint                         pipelineBindPoint,
+    VkPipeline                                  pipeline)
 {
    struct command_buffer_data *cmd_buffer_data =
-      FIND(struct command_buffer_data, commandBuffer);
-   struct device_data *device_data = cmd_buffer_data->device;
-
-   return device_data->vtable.ResetCommandBuffer(commandBuffer, flags);
+      count_command(commandBuffer, DRAW_COUNTER_pipeline_binds);
+   cmd_buffer_data->device->vtable.CmdBindPipeline(commandBuffer, pipelineBindPoint, pipeline);
 }
 
-static void overlay_CmdExecuteCommands(
+static void overlay_CmdBindDescriptorSets(
     VkCommandBuffer                             commandBuffer,
-    uint32_t                                    commandBufferCount,
-    const VkCommandBuffer*                      pCommandBuffers)
+    VkPipelineBindPoint                         pipelineBindPoint,
+    VkPipelineLayout                            layout,
+    uint32_t                                    firstSet,
+    uint32_t                                    descriptorSetCount,
+    const VkDescriptorSet*                      pDescriptorSets,
+    uint32_t                                    dynamicOffsetCount,
+    const uint32_t*                             pDynamicOffsets)
 {
    struct command_buffer_data *cmd_buffer_data =
-      FIND(struct command_buffer_data, commandBuffer);
-   struct device_data *device_data = cmd_buffer_data->device;
-
-   device_data->vtable.CmdExecuteCommands(commandBuffer, commandBufferCount, pCommandBuffers);
+      count_command(commandBuffer, DRAW_COUNTER_descriptor_binds);
+   cmd_buffer_data->device->vtable.CmdBindDescriptorSets(commandBuffer, pipelineBindPoint,
+                                                         layout, firstSet,
+                                                         descriptorSetCount, pDescriptorSets,
+                                                         dynamicOffsetCount, pDynamicOffsets);
 }
 
 static VkResult overlay_AllocateCommandBuffers(
@@ -2552,6 +5336,282 @@ static void overlay_FreeCommandBuffers(
                                           commandBufferCount, pCommandBuffers);
 }
 
+/* GPU time of the application's work on a queue. Every vkQueueSubmit gets
+ * a timestamp written before its first command buffer and one after its
+ * last, by command buffers prerecorded once per query. At each present the
+ * queries since the previous one make up a frame, read back later without
+ * waiting. The frame's busy time is the union of its submissions' spans.
+ */
+#define GPU_TIMER_QUERIES 512 /* even, queries come in begin/end pairs */
+#define GPU_TIMER_FRAMES 32
+
+struct gpu_timer {
+   std::mutex lock;
+
+   VkQueryPool query_pool;
+   VkCommandPool command_pool;
+   VkCommandBuffer command_buffers[GPU_TIMER_QUERIES];
+
+   /* Monotonic query positions, the slot is position % GPU_TIMER_QUERIES.
+    * Queries before read_query have been read back and can be reused.
+    */
+   uint64_t next_query;
+   uint64_t read_query;
+   uint64_t frame_query; /* first query of the frame being submitted */
+
+   /* Frames waiting for their results, [first, end) queries each */
+   struct {
+      uint64_t first_query, end_query;
+   } frames[GPU_TIMER_FRAMES];
+   uint64_t frame_head, frame_tail;
+
+   uint64_t results[GPU_TIMER_QUERIES];
+   uint64_t busy; /* us, of the last frame read back */
+
+   /* Scratch space for the wrapped submissions */
+   std::vector<VkSubmitInfo> submits;
+   std::vector<VkCommandBuffer> first_command_buffers, last_command_buffers;
+};
+
+static void create_gpu_timer(struct queue_data *queue_data)
+{
+   struct device_data *device_data = queue_data->device;
+   struct gpu_timer *timer = new gpu_timer();
+
+   VkQueryPoolCreateInfo pool_info = {};
+   pool_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+   pool_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+   pool_info.queryCount = GPU_TIMER_QUERIES;
+   VK_CHECK(device_data->vtable.CreateQueryPool(device_data->device, &pool_info,
+                                                NULL, &timer->query_pool));
+
+   VkCommandPoolCreateInfo cmd_pool_info = {};
+   cmd_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+   cmd_pool_info.queueFamilyIndex = queue_data->family_index;
+   VK_CHECK(device_data->vtable.CreateCommandPool(device_data->device, &cmd_pool_info,
+                                                  NULL, &timer->command_pool));
+
+   VkCommandBufferAllocateInfo cmd_buffer_info = {};
+   cmd_buffer_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+   cmd_buffer_info.commandPool = timer->command_pool;
+   cmd_buffer_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+   cmd_buffer_info.commandBufferCount = GPU_TIMER_QUERIES;
+   VK_CHECK(device_data->vtable.AllocateCommandBuffers(device_data->device,
+                                                       &cmd_buffer_info,
+                                                       timer->command_buffers));
+
+   for (uint32_t i = 0; i < GPU_TIMER_QUERIES; i++) {
+      VkCommandBuffer command_buffer = timer->command_buffers[i];
+      VK_CHECK(device_data->set_device_loader_data(device_data->device, command_buffer));
+
+      VkCommandBufferBeginInfo begin_info = {};
+      begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+      device_data->vtable.BeginCommandBuffer(command_buffer, &begin_info);
+      device_data->vtable.CmdResetQueryPool(command_buffer, timer->query_pool, i, 1);
+      device_data->vtable.CmdWriteTimestamp(command_buffer,
+                                            (i & 1) ? VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT :
+                                                      VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                                            timer->query_pool, i);
+      device_data->vtable.EndCommandBuffer(command_buffer);
+   }
+
+   queue_data->gpu_timer = timer;
+}
+
+static void destroy_gpu_timer(struct queue_data *queue_data)
+{
+   struct device_data *device_data = queue_data->device;
+   struct gpu_timer *timer = queue_data->gpu_timer;
+   if (!timer)
+      return;
+
+   device_data->vtable.DestroyCommandPool(device_data->device, timer->command_pool, NULL);
+   device_data->vtable.DestroyQueryPool(device_data->device, timer->query_pool, NULL);
+   delete timer;
+   queue_data->gpu_timer = NULL;
+}
+
+/* Command buffers can't be added to these without breaking them */
+static bool gpu_timer_can_wrap(uint32_t submitCount, const VkSubmitInfo *pSubmits)
+{
+   for (uint32_t i = 0; i < submitCount; i++) {
+      for (const VkBaseInStructure *ext = (const VkBaseInStructure *)pSubmits[i].pNext;
+           ext; ext = ext->pNext) {
+         if (ext->sType == VK_STRUCTURE_TYPE_DEVICE_GROUP_SUBMIT_INFO ||
+             ext->sType == VK_STRUCTURE_TYPE_PROTECTED_SUBMIT_INFO)
+            return false;
+      }
+   }
+   return submitCount > 0;
+}
+
+static VkResult gpu_timer_submit(struct queue_data *queue_data,
+                                 uint32_t submitCount,
+                                 const VkSubmitInfo *pSubmits,
+                                 VkFence fence)
+{
+   struct device_data *device_data = queue_data->device;
+   struct gpu_timer *timer = queue_data->gpu_timer;
+   scoped_lock lk(timer->lock);
+
+   /* Out of queries until older frames are read back, leave it untimed */
+   if (timer->next_query + 2 - timer->read_query > GPU_TIMER_QUERIES)
+      return device_data->vtable.QueueSubmit(queue_data->queue, submitCount, pSubmits, fence);
+
+   uint32_t slot = timer->next_query % GPU_TIMER_QUERIES;
+   const VkSubmitInfo *first = &pSubmits[0];
+   const VkSubmitInfo *last = &pSubmits[submitCount - 1];
+
+   timer->submits.assign(pSubmits, pSubmits + submitCount);
+
+   timer->first_command_buffers.clear();
+   timer->first_command_buffers.push_back(timer->command_buffers[slot]);
+   timer->first_command_buffers.insert(timer->first_command_buffers.end(),
+                                       first->pCommandBuffers,
+                                       first->pCommandBuffers + first->commandBufferCount);
+   if (submitCount == 1) {
+      timer->first_command_buffers.push_back(timer->command_buffers[slot + 1]);
+   } else {
+      timer->last_command_buffers.assign(last->pCommandBuffers,
+                                         last->pCommandBuffers + last->commandBufferCount);
+      timer->last_command_buffers.push_back(timer->command_buffers[slot + 1]);
+      timer->submits.back().commandBufferCount = timer->last_command_buffers.size();
+      timer->submits.back().pCommandBuffers = timer->last_command_buffers.data();
+   }
+   timer->submits.front().commandBufferCount = timer->first_command_buffers.size();
+   timer->submits.front().pCommandBuffers = timer->first_command_buffers.data();
+
+   VkResult result = device_data->vtable.QueueSubmit(queue_data->queue, submitCount,
+                                                     timer->submits.data(), fence);
+   /* Queries that never get written would hold up every later frame */
+   if (result == VK_SUCCESS)
+      timer->next_query += 2;
+   return result;
+}
+
+/* Busy time of the [begin, end) query pairs in timer->results */
+static uint64_t gpu_timer_busy(struct queue_data *queue_data, uint64_t first, uint64_t end)
+{
+   struct gpu_timer *timer = queue_data->gpu_timer;
+   uint64_t mask = queue_data->timestamp_valid_bits >= 64 ?
+      UINT64_MAX : (1ull << queue_data->timestamp_valid_bits) - 1;
+   uint64_t busy = 0, cursor = 0;
+
+   for (uint64_t q = first; q < end; q += 2) {
+      uint64_t begin_ts = timer->results[q % GPU_TIMER_QUERIES] & mask;
+      uint64_t end_ts = timer->results[(q + 1) % GPU_TIMER_QUERIES] & mask;
+      uint64_t start = std::max(begin_ts, cursor);
+      if (end_ts > start)
+         busy += end_ts - start;
+      cursor = std::max(cursor, end_ts);
+   }
+
+   float period = queue_data->device->properties.limits.timestampPeriod; /* ns */
+   return busy * period / 1000;
+}
+
+static bool gpu_timer_read(struct queue_data *queue_data, uint64_t first, uint64_t end)
+{
+   struct device_data *device_data = queue_data->device;
+   struct gpu_timer *timer = queue_data->gpu_timer;
+
+   /* The range may wrap around the pool */
+   while (first < end) {
+      uint32_t slot = first % GPU_TIMER_QUERIES;
+      uint32_t count = std::min<uint64_t>(end - first, GPU_TIMER_QUERIES - slot);
+      VkResult result =
+         device_data->vtable.GetQueryPoolResults(device_data->device, timer->query_pool,
+                                                 slot, count,
+                                                 count * sizeof(uint64_t),
+                                                 &timer->results[slot],
+                                                 sizeof(uint64_t),
+                                                 VK_QUERY_RESULT_64_BIT);
+      if (result != VK_SUCCESS)
+         return false;
+      first += count;
+   }
+   return true;
+}
+
+/* Closes the frame submitted since the last present and reads back the
+ * frames whose results are ready. Returns the busy time of the last frame
+ * read, in us.
+ */
+static uint64_t gpu_timer_present(struct queue_data *queue_data)
+{
+   struct gpu_timer *timer = queue_data->gpu_timer;
+   scoped_lock lk(timer->lock);
+
+   /* With every frame slot pending, the next present closes both */
+   if (timer->next_query > timer->frame_query &&
+       timer->frame_head - timer->frame_tail < GPU_TIMER_FRAMES) {
+      auto& frame = timer->frames[timer->frame_head++ % GPU_TIMER_FRAMES];
+      frame.first_query = timer->frame_query;
+      frame.end_query = timer->frame_query = timer->next_query;
+   }
+
+   while (timer->frame_tail < timer->frame_head) {
+      auto& frame = timer->frames[timer->frame_tail % GPU_TIMER_FRAMES];
+      if (!gpu_timer_read(queue_data, frame.first_query, frame.end_query))
+         break;
+      timer->busy = gpu_timer_busy(queue_data, frame.first_query, frame.end_query);
+      timer->read_query = frame.end_query;
+      timer->frame_tail++;
+   }
+
+   return timer->busy;
+}
+
+/* Render nodes have no keyboard to toggle logging with, a headless
+ * device logs until log_duration or until it is destroyed.
+ */
+static void stop_headless_logging()
+{
+   swap_array(&write_buffer, &read_buffer);
+   log_size = log_i;
+   log_i = 0;
+   write_file(&log_file);
+   log_file.flush();
+   log_file.close();
+   loggingOn = false;
+}
+
+/* Frame boundary of a device without swapchain, for headless. The frame
+ * stats are taken as a present would and sampled and logged, nothing is
+ * rendered. Called from submitting or waiting threads.
+ */
+static void headless_frame(struct device_data *device_data)
+{
+   if (!device_data->headless || device_data->has_swapchain)
+      return;
+
+   scoped_lock lk(device_data->headless_lock);
+   struct swapchain_data *data = device_data->headless;
+   struct overlay_params& params = device_data->instance->params;
+
+   if (!data->sw_stats.n_frames && !params.output_file.empty() && !loggingOn) {
+      log_file = create_file(params);
+      loggingOn = true;
+   }
+
+   struct queue_data *timed_queue = device_data->graphic_queue;
+   if (timed_queue && timed_queue->gpu_timer)
+      data->sw_stats.gpu_frametime = gpu_timer_present(timed_queue);
+   set_compile_stats(&data->sw_stats, take_compile_stats(device_data));
+   if (params.submit_stats || (device_data->hooks & OVERLAY_HOOKS_DRAW)) {
+      uint64_t submit_counters[SUBMIT_COUNTER_MAX];
+      for (unsigned c = 0; c < SUBMIT_COUNTER_MAX; c++)
+         submit_counters[c] = device_data->submit_counters.sum(c);
+      set_submit_stats(data, submit_counters);
+   }
+   if (device_data->hooks & OVERLAY_HOOKS_WAIT)
+      set_wait_stats(data);
+   if (device_data->hooks & OVERLAY_HOOKS_MEMORY)
+      update_memory_stats(data);
+
+   snapshot_swapchain_frame(data);
+}
+
 static VkResult overlay_QueueSubmit(
     VkQueue                                     queue,
     uint32_t                                    submitCount,
@@ -2560,8 +5620,472 @@ static VkResult overlay_QueueSubmit(
 {
    struct queue_data *queue_data = FIND(struct queue_data, queue);
    struct device_data *device_data = queue_data->device;
+   bool submit_stats = device_data->instance->params.submit_stats;
+
+   uint64_t start = submit_stats ? os_time_get_nano() : 0;
+   VkResult result;
+   if (queue_data->gpu_timer && gpu_timer_can_wrap(submitCount, pSubmits))
+      result = gpu_timer_submit(queue_data, submitCount, pSubmits, fence);
+   else
+      result = device_data->vtable.QueueSubmit(queue, submitCount, pSubmits, fence);
+
+   thread_counters<SUBMIT_COUNTER_MAX>& counters = device_data->submit_counters;
+   if (submit_stats) {
+      counters.add(SUBMIT_COUNTER_submit_time, os_time_get_nano() - start);
+      counters.add(SUBMIT_COUNTER_submits, 1);
+      counters.add(SUBMIT_COUNTER_batches, submitCount);
+      for (uint32_t i = 0; i < submitCount; i++)
+         counters.add(SUBMIT_COUNTER_command_buffers, pSubmits[i].commandBufferCount);
+   }
+
+   /* Fold the command buffers' counts into the frame */
+   if (device_data->hooks & OVERLAY_HOOKS_DRAW) {
+      uint64_t submitted[DRAW_COUNTER_MAX] = {};
+      for (uint32_t i = 0; i < submitCount; i++) {
+         for (uint32_t j = 0; j < pSubmits[i].commandBufferCount; j++) {
+            struct command_buffer_data *cmd_buffer_data =
+               FIND(struct command_buffer_data, pSubmits[i].pCommandBuffers[j]);
+            if (!cmd_buffer_data)
+               continue;
+            for (unsigned c = 0; c < DRAW_COUNTER_MAX; c++)
+               submitted[c] += cmd_buffer_data->counters[c];
+         }
+      }
+      for (unsigned c = 0; c < DRAW_COUNTER_MAX; c++)
+         counters.add(SUBMIT_COUNTER_draws + c, submitted[c]);
+   }
+
+   if (device_data->instance->params.headless == HEADLESS_SUBMIT)
+      headless_frame(device_data);
+   return result;
+}
+
+static void account_wait(struct device_data *device_data, uint64_t start)
+{
+   uint64_t elapsed = os_time_get_nano() - start;
+   device_data->wait_counters.add(WAIT_COUNTER_waits, 1);
+   device_data->wait_counters.add(WAIT_COUNTER_wait_time, elapsed);
+   thread_wait_ns += elapsed;
+}
+
+static VkResult overlay_WaitForFences(
+    VkDevice                                    device,
+    uint32_t                                    fenceCount,
+    const VkFence*                              pFences,
+    VkBool32                                    waitAll,
+    uint64_t                                    timeout)
+{
+   struct device_data *device_data = FIND(struct device_data, device);
+
+   /* Polling doesn't block */
+   if (timeout == 0)
+      return device_data->vtable.WaitForFences(device, fenceCount, pFences, waitAll, timeout);
+
+   uint64_t start = os_time_get_nano();
+   VkResult result = device_data->vtable.WaitForFences(device, fenceCount, pFences,
+                                                       waitAll, timeout);
+   account_wait(device_data, start);
+   if (device_data->instance->params.headless == HEADLESS_WAIT)
+      headless_frame(device_data);
+   return result;
+}
+
+static VkResult overlay_WaitSemaphores(
+    VkDevice                                    device,
+    const VkSemaphoreWaitInfo*                  pWaitInfo,
+    uint64_t                                    timeout)
+{
+   struct device_data *device_data = FIND(struct device_data, device);
+
+   if (timeout == 0)
+      return device_data->vtable.WaitSemaphores(device, pWaitInfo, timeout);
+
+   uint64_t start = os_time_get_nano();
+   VkResult result = device_data->vtable.WaitSemaphores(device, pWaitInfo, timeout);
+   account_wait(device_data, start);
+   if (device_data->instance->params.headless == HEADLESS_WAIT)
+      headless_frame(device_data);
+   return result;
+}
+
+static VkResult overlay_QueueWaitIdle(
+    VkQueue                                     queue)
+{
+   struct queue_data *queue_data = FIND(struct queue_data, queue);
+   struct device_data *device_data = queue_data->device;
+
+   uint64_t start = os_time_get_nano();
+   VkResult result = device_data->vtable.QueueWaitIdle(queue);
+   account_wait(device_data, start);
+   if (device_data->instance->params.headless == HEADLESS_WAIT)
+      headless_frame(device_data);
+   return result;
+}
+
+static VkResult overlay_DeviceWaitIdle(
+    VkDevice                                    device)
+{
+   struct device_data *device_data = FIND(struct device_data, device);
+
+   uint64_t start = os_time_get_nano();
+   VkResult result = device_data->vtable.DeviceWaitIdle(device);
+   account_wait(device_data, start);
+   if (device_data->instance->params.headless == HEADLESS_WAIT)
+      headless_frame(device_data);
+   return result;
+}
+
+static VkResult overlay_GetQueryPoolResults(
+    VkDevice                                    device,
+    VkQueryPool                                 queryPool,
+    uint32_t                                    firstQuery,
+    uint32_t                                    queryCount,
+    size_t                                      dataSize,
+    void*                                       pData,
+    VkDeviceSize                                stride,
+    VkQueryResultFlags                          flags)
+{
+   struct device_data *device_data = FIND(struct device_data, device);
+
+   if (!(flags & VK_QUERY_RESULT_WAIT_BIT)) {
+      return device_data->vtable.GetQueryPoolResults(device, queryPool, firstQuery,
+                                                     queryCount, dataSize, pData,
+                                                     stride, flags);
+   }
+
+   uint64_t start = os_time_get_nano();
+   VkResult result = device_data->vtable.GetQueryPoolResults(device, queryPool, firstQuery,
+                                                             queryCount, dataSize, pData,
+                                                             stride, flags);
+   account_wait(device_data, start);
+   return result;
+}
+
+/* Hook groups the enabled features need on a new device. By default
+ * only the swapchain/present path is intercepted.
+ */
+static uint32_t device_hooks_needed(const struct overlay_params& params)
+{
+   uint32_t hooks = 0;
+   if (params.gpu_frametime || params.bound_by || params.submit_stats)
+      hooks |= OVERLAY_HOOKS_QUEUE_SUBMIT;
+   if (params.draw_stats)
+      hooks |= OVERLAY_HOOKS_COMMAND_BUFFER | OVERLAY_HOOKS_DRAW | OVERLAY_HOOKS_QUEUE_SUBMIT;
+   if (params.wait_stats)
+      hooks |= OVERLAY_HOOKS_WAIT;
+   if (params.process_vram)
+      hooks |= OVERLAY_HOOKS_MEMORY;
+   if (params.bound_by)
+      hooks |= OVERLAY_HOOKS_ACQUIRE;
+   if (params.compile_stats)
+      hooks |= OVERLAY_HOOKS_PIPELINE;
+   if (params.headless == HEADLESS_SUBMIT)
+      hooks |= OVERLAY_HOOKS_QUEUE_SUBMIT;
+   if (params.headless == HEADLESS_WAIT)
+      hooks |= OVERLAY_HOOKS_WAIT;
+   return hooks;
+}
+
+static bool device_has_extension(struct instance_data *instance_data,
+                                 VkPhysicalDevice physical_device,
+                                 const char *name)
+{
+   uint32_t n_extensions = 0;
+   instance_data->vtable.EnumerateDeviceExtensionProperties(physical_device, NULL,
+                                                            &n_extensions, NULL);
+   std::vector<VkExtensionProperties> extensions(n_extensions);
+   instance_data->vtable.EnumerateDeviceExtensionProperties(physical_device, NULL,
+                                                            &n_extensions,
+                                                            extensions.data());
+   for (auto& ext : extensions) {
+      if (!strcmp(ext.extensionName, name))
+         return true;
+   }
+   return false;
+}
+
+/* Adds 'name' to the device extensions unless the application already
+ * enables it. 'extensions' holds the application's list and outlives
+ * device creation.
+ */
+static void enable_device_extension(VkDeviceCreateInfo *device_info,
+                                    std::vector<const char *>& extensions,
+                                    const char *name)
+{
+   for (auto ext : extensions) {
+      if (!strcmp(ext, name))
+         return;
+   }
+   extensions.push_back(name);
+   device_info->enabledExtensionCount = extensions.size();
+   device_info->ppEnabledExtensionNames = extensions.data();
+}
+
+/* Size of the device create info extension structs the layer knows how
+ * to copy, 0 for the others.
+ */
+static size_t device_create_struct_size(VkStructureType type)
+{
+   switch (type) {
+   case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2:
+      return sizeof(VkPhysicalDeviceFeatures2);
+   case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_FEATURES:
+      return sizeof(VkPhysicalDeviceVulkan11Features);
+   case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES:
+      return sizeof(VkPhysicalDeviceVulkan12Features);
+   case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_16BIT_STORAGE_FEATURES:
+      return sizeof(VkPhysicalDevice16BitStorageFeatures);
+   case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_8BIT_STORAGE_FEATURES:
+      return sizeof(VkPhysicalDevice8BitStorageFeatures);
+   case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_BUFFER_DEVICE_ADDRESS_FEATURES:
+      return sizeof(VkPhysicalDeviceBufferDeviceAddressFeatures);
+   case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES:
+      return sizeof(VkPhysicalDeviceDescriptorIndexingFeatures);
+   case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_HOST_QUERY_RESET_FEATURES:
+      return sizeof(VkPhysicalDeviceHostQueryResetFeatures);
+   case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGELESS_FRAMEBUFFER_FEATURES:
+      return sizeof(VkPhysicalDeviceImagelessFramebufferFeatures);
+   case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MULTIVIEW_FEATURES:
+      return sizeof(VkPhysicalDeviceMultiviewFeatures);
+   case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SAMPLER_YCBCR_CONVERSION_FEATURES:
+      return sizeof(VkPhysicalDeviceSamplerYcbcrConversionFeatures);
+   case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SCALAR_BLOCK_LAYOUT_FEATURES:
+      return sizeof(VkPhysicalDeviceScalarBlockLayoutFeatures);
+   case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SHADER_DRAW_PARAMETERS_FEATURES:
+      return sizeof(VkPhysicalDeviceShaderDrawParametersFeatures);
+   case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SHADER_FLOAT16_INT8_FEATURES:
+      return sizeof(VkPhysicalDeviceShaderFloat16Int8Features);
+   case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES:
+      return sizeof(VkPhysicalDeviceTimelineSemaphoreFeatures);
+   case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_UNIFORM_BUFFER_STANDARD_LAYOUT_FEATURES:
+      return sizeof(VkPhysicalDeviceUniformBufferStandardLayoutFeatures);
+   case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VARIABLE_POINTERS_FEATURES:
+      return sizeof(VkPhysicalDeviceVariablePointersFeatures);
+   case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_MEMORY_MODEL_FEATURES:
+      return sizeof(VkPhysicalDeviceVulkanMemoryModelFeatures);
+   case VK_STRUCTURE_TYPE_DEVICE_GROUP_DEVICE_CREATE_INFO:
+      return sizeof(VkDeviceGroupDeviceCreateInfo);
+#ifdef VK_KHR_present_wait
+   case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR:
+      return sizeof(VkPhysicalDevicePresentIdFeaturesKHR);
+   case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR:
+      return sizeof(VkPhysicalDevicePresentWaitFeaturesKHR);
+#endif
+   default:
+      return 0;
+   }
+}
+
+static const VkBaseInStructure *find_device_create_struct(const VkDeviceCreateInfo *device_info,
+                                                          VkStructureType type)
+{
+   for (const VkBaseInStructure *ext = (const VkBaseInStructure *)device_info->pNext;
+        ext; ext = ext->pNext) {
+      if (ext->sType == type)
+         return ext;
+   }
+   return NULL;
+}
+
+/* The application's structs are const, the layer patches copies instead.
+ * Returns the copy of the 'type' struct of device_info's chain, copying it
+ * and the structs before it into 'copies' which must outlive device
+ * creation. NULL if one of them is of a type the layer can't copy.
+ */
+static VkBaseOutStructure *copy_device_create_struct(VkDeviceCreateInfo *device_info,
+                                                     std::vector<std::vector<char>>& copies,
+                                                     VkStructureType type)
+{
+   const void **link = &device_info->pNext;
+   while (*link) {
+      VkBaseOutStructure *copy = NULL;
+      for (auto& c : copies) {
+         if (c.data() == *link)
+            copy = (VkBaseOutStructure *)c.data();
+      }
+
+      if (!copy) {
+         const char *ext = (const char *)*link;
+         size_t size = device_create_struct_size(((const VkBaseInStructure *)ext)->sType);
+         if (!size)
+            return NULL;
+         /* Moving the vectors around keeps their data where it is */
+         copies.emplace_back(ext, ext + size);
+         copy = (VkBaseOutStructure *)copies.back().data();
+         *link = copy;
+      }
+
+      if (copy->sType == type)
+         return copy;
+      link = (const void **)&copy->pNext;
+   }
+   return NULL;
+}
+
+/* Enables timeline semaphores for the layer's own completion tracking if
+ * the device has them. 'features' is chained in unless the application
+ * already passes a struct covering the feature, a copy of which gets
+ * patched if the feature is off there.
+ */
+static bool enable_timeline_semaphore(struct instance_data *instance_data,
+                                      VkPhysicalDevice physical_device,
+                                      VkDeviceCreateInfo *device_info,
+                                      std::vector<const char *>& extensions,
+                                      std::vector<std::vector<char>>& copies,
+                                      VkPhysicalDeviceTimelineSemaphoreFeaturesKHR *features)
+{
+   if (!instance_data->properties2 ||
+       !device_has_extension(instance_data, physical_device,
+                             VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME))
+      return false;
+
+   const VkBaseInStructure *ext;
+   if ((ext = find_device_create_struct(device_info, VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES))) {
+      if (!((const VkPhysicalDeviceVulkan12Features *)ext)->timelineSemaphore) {
+         VkBaseOutStructure *copy = copy_device_create_struct(device_info, copies, ext->sType);
+         if (!copy)
+            return false;
+         ((VkPhysicalDeviceVulkan12Features *)copy)->timelineSemaphore = VK_TRUE;
+      }
+   } else if ((ext = find_device_create_struct(device_info, VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR))) {
+      if (!((const VkPhysicalDeviceTimelineSemaphoreFeaturesKHR *)ext)->timelineSemaphore) {
+         VkBaseOutStructure *copy = copy_device_create_struct(device_info, copies, ext->sType);
+         if (!copy)
+            return false;
+         ((VkPhysicalDeviceTimelineSemaphoreFeaturesKHR *)copy)->timelineSemaphore = VK_TRUE;
+      }
+   } else {
+      features->sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR;
+      features->pNext = (void *)device_info->pNext;
+      features->timelineSemaphore = VK_TRUE;
+      device_info->pNext = features;
+   }
+
+   enable_device_extension(device_info, extensions,
+                           VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME);
+   return true;
+}
+
+#ifdef VK_KHR_present_wait
+/* Enables present ids and waits for the present latency stats if the
+ * device supports both. Left alone when the application uses present_wait
+ * itself, the layer's waits would race with its own on the swapchain.
+ */
+static bool enable_present_wait(struct instance_data *instance_data,
+                                VkPhysicalDevice physical_device,
+                                VkDeviceCreateInfo *device_info,
+                                std::vector<const char *>& extensions,
+                                std::vector<std::vector<char>>& copies,
+                                VkPhysicalDevicePresentIdFeaturesKHR *id_features,
+                                VkPhysicalDevicePresentWaitFeaturesKHR *wait_features)
+{
+   if (!instance_data->properties2 ||
+       !device_has_extension(instance_data, physical_device,
+                             VK_KHR_PRESENT_ID_EXTENSION_NAME) ||
+       !device_has_extension(instance_data, physical_device,
+                             VK_KHR_PRESENT_WAIT_EXTENSION_NAME))
+      return false;
+
+   for (auto ext : extensions) {
+      if (!strcmp(ext, VK_KHR_PRESENT_WAIT_EXTENSION_NAME))
+         return false;
+   }
+
+   /* The alias isn't in the dispatch table, 1.0 instances need it */
+   PFN_vkGetPhysicalDeviceFeatures2 get_features2 =
+      instance_data->api_version >= VK_API_VERSION_1_1 ?
+      instance_data->vtable.GetPhysicalDeviceFeatures2 :
+      (PFN_vkGetPhysicalDeviceFeatures2)
+      instance_data->vtable.GetInstanceProcAddr(instance_data->instance,
+                                                "vkGetPhysicalDeviceFeatures2KHR");
+   if (!get_features2)
+      return false;
+
+   VkPhysicalDevicePresentWaitFeaturesKHR wait_supported = {};
+   wait_supported.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR;
+   VkPhysicalDevicePresentIdFeaturesKHR id_supported = {};
+   id_supported.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR;
+   id_supported.pNext = &wait_supported;
+   VkPhysicalDeviceFeatures2 features = {};
+   features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+   features.pNext = &id_supported;
+   get_features2(physical_device, &features);
+   if (!id_supported.presentId || !wait_supported.presentWait)
+      return false;
+
+   /* Patches copies of the application's structs, see enable_timeline_semaphore() */
+   const VkBaseInStructure *id_ext =
+      find_device_create_struct(device_info, VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR);
+   const VkBaseInStructure *wait_ext =
+      find_device_create_struct(device_info, VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR);
+   VkBaseOutStructure *id_copy = NULL, *wait_copy = NULL;
+   if (id_ext && !((const VkPhysicalDevicePresentIdFeaturesKHR *)id_ext)->presentId &&
+       !(id_copy = copy_device_create_struct(device_info, copies, id_ext->sType)))
+      return false;
+   if (wait_ext && !((const VkPhysicalDevicePresentWaitFeaturesKHR *)wait_ext)->presentWait &&
+       !(wait_copy = copy_device_create_struct(device_info, copies, wait_ext->sType)))
+      return false;
+   if (id_copy)
+      ((VkPhysicalDevicePresentIdFeaturesKHR *)id_copy)->presentId = VK_TRUE;
+   if (wait_copy)
+      ((VkPhysicalDevicePresentWaitFeaturesKHR *)wait_copy)->presentWait = VK_TRUE;
+
+   enable_device_extension(device_info, extensions, VK_KHR_PRESENT_ID_EXTENSION_NAME);
+   enable_device_extension(device_info, extensions, VK_KHR_PRESENT_WAIT_EXTENSION_NAME);
+
+   if (!id_ext) {
+      id_features->sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR;
+      id_features->pNext = (void *)device_info->pNext;
+      id_features->presentId = VK_TRUE;
+      device_info->pNext = id_features;
+   }
+   if (!wait_ext) {
+      wait_features->sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR;
+      wait_features->pNext = (void *)device_info->pNext;
+      wait_features->presentWait = VK_TRUE;
+      device_info->pNext = wait_features;
+   }
+   return true;
+}
+#endif
+
+/* Aliases aren't in the dispatch table, 1.0 instances only have the KHR
+ * entry points of VK_KHR_get_physical_device_properties2.
+ */
+static PFN_vkGetPhysicalDeviceMemoryProperties2
+get_physical_device_memory_properties2(struct instance_data *instance_data)
+{
+   if (instance_data->api_version >= VK_API_VERSION_1_1)
+      return instance_data->vtable.GetPhysicalDeviceMemoryProperties2;
+   return (PFN_vkGetPhysicalDeviceMemoryProperties2)
+      instance_data->vtable.GetInstanceProcAddr(instance_data->instance,
+                                                "vkGetPhysicalDeviceMemoryProperties2KHR");
+}
 
-   return device_data->vtable.QueueSubmit(queue, submitCount, pSubmits, fence);
+/* The hooks of the ALIAS_HOOK entries call the core name's dispatch entry,
+ * which is NULL on devices that only have the extension's version.
+ */
+static void load_device_aliases(VkDevice device, PFN_vkGetDeviceProcAddr gpa,
+                                struct vk_device_dispatch_table *table)
+{
+   if (!table->CmdDrawIndirectCount)
+      table->CmdDrawIndirectCount =
+         (PFN_vkCmdDrawIndirectCount) gpa(device, "vkCmdDrawIndirectCountKHR");
+   if (!table->CmdDrawIndirectCount)
+      table->CmdDrawIndirectCount =
+         (PFN_vkCmdDrawIndirectCount) gpa(device, "vkCmdDrawIndirectCountAMD");
+   if (!table->CmdDrawIndexedIndirectCount)
+      table->CmdDrawIndexedIndirectCount =
+         (PFN_vkCmdDrawIndexedIndirectCount) gpa(device, "vkCmdDrawIndexedIndirectCountKHR");
+   if (!table->CmdDrawIndexedIndirectCount)
+      table->CmdDrawIndexedIndirectCount =
+         (PFN_vkCmdDrawIndexedIndirectCount) gpa(device, "vkCmdDrawIndexedIndirectCountAMD");
+   if (!table->CmdDispatchBase)
+      table->CmdDispatchBase =
+         (PFN_vkCmdDispatchBase) gpa(device, "vkCmdDispatchBaseKHR");
+   if (!table->WaitSemaphores)
+      table->WaitSemaphores =
+         (PFN_vkWaitSemaphores) gpa(device, "vkWaitSemaphoresKHR");
 }
 
 static VkResult overlay_CreateDevice(
@@ -2593,40 +6117,161 @@ static VkResult overlay_CreateDevice(
       device_features = *(pCreateInfo->pEnabledFeatures);
    device_info.pEnabledFeatures = &device_features;
 
+   std::vector<const char *> enabled_extensions(pCreateInfo->ppEnabledExtensionNames,
+                                                pCreateInfo->ppEnabledExtensionNames +
+                                                pCreateInfo->enabledExtensionCount);
+   VkPhysicalDeviceTimelineSemaphoreFeaturesKHR timeline_features = {};
+   std::vector<std::vector<char>> create_struct_copies;
+   bool timeline_semaphore = false;
+   bool present_wait = false;
+   bool pipeline_feedback = false;
+   bool memory_budget = false;
+   bool display_timing = false;
+#ifdef VK_KHR_present_wait
+   VkPhysicalDevicePresentIdFeaturesKHR present_id_features = {};
+   VkPhysicalDevicePresentWaitFeaturesKHR present_wait_features = {};
+#endif
+   if (!is_blacklisted()) {
+      timeline_semaphore =
+         enable_timeline_semaphore(instance_data, physicalDevice, &device_info,
+                                   enabled_extensions, create_struct_copies,
+                                   &timeline_features);
+#ifdef VK_KHR_present_wait
+      if (instance_data->params.present_latency)
+         present_wait =
+            enable_present_wait(instance_data, physicalDevice, &device_info,
+                                enabled_extensions, create_struct_copies,
+                                &present_id_features,
+                                &present_wait_features);
+#else
+      static std::atomic<bool> present_latency_warned;
+      if (instance_data->params.present_latency && !present_latency_warned.exchange(true))
+         std::cerr << "MANGOHUD: present_latency needs a build with VK_KHR_present_wait headers\n";
+#endif
+      if (instance_data->params.compile_stats &&
+          device_has_extension(instance_data, physicalDevice,
+                               VK_EXT_PIPELINE_CREATION_FEEDBACK_EXTENSION_NAME)) {
+         enable_device_extension(&device_info, enabled_extensions,
+                                 VK_EXT_PIPELINE_CREATION_FEEDBACK_EXTENSION_NAME);
+         pipeline_feedback = true;
+      }
+      if (instance_data->params.process_vram && instance_data->properties2 &&
+          device_has_extension(instance_data, physicalDevice,
+                               VK_EXT_MEMORY_BUDGET_EXTENSION_NAME)) {
+         enable_device_extension(&device_info, enabled_extensions,
+                                 VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+         memory_budget = true;
+      }
+      if (instance_data->params.display_timing &&
+          device_has_extension(instance_data, physicalDevice,
+                               VK_GOOGLE_DISPLAY_TIMING_EXTENSION_NAME)) {
+         enable_device_extension(&device_info, enabled_extensions,
+                                 VK_GOOGLE_DISPLAY_TIMING_EXTENSION_NAME);
+         display_timing = true;
+      }
+   }
 
    VkResult result = fpCreateDevice(physicalDevice, &device_info, pAllocator, pDevice);
    if (result != VK_SUCCESS) return result;
 
    struct device_data *device_data = new_device_data(*pDevice, instance_data);
    device_data->physical_device = physicalDevice;
+   device_data->timeline_semaphore = timeline_semaphore;
+   device_data->present_wait = present_wait;
+   device_data->pipeline_feedback = pipeline_feedback;
+   device_data->display_timing = display_timing;
+   if (memory_budget)
+      device_data->get_memory_properties2 = get_physical_device_memory_properties2(instance_data);
    vk_load_device_commands(*pDevice, fpGetDeviceProcAddr, &device_data->vtable);
+   load_device_aliases(*pDevice, fpGetDeviceProcAddr, &device_data->vtable);
 
    instance_data->vtable.GetPhysicalDeviceProperties(device_data->physical_device,
                                                      &device_data->properties);
+   instance_data->vtable.GetPhysicalDeviceMemoryProperties(device_data->physical_device,
+                                                           &device_data->memory_properties);
 
    VkLayerDeviceCreateInfo *load_data_info =
       get_device_chain_info(pCreateInfo, VK_LOADER_DATA_CALLBACK);
    device_data->set_device_loader_data = load_data_info->u.pfnSetDeviceLoaderData;
 
    if (!is_blacklisted()) {
+      device_data->hooks = device_hooks_needed(instance_data->params);
+      if (device_data->present_wait)
+         device_data->hooks |= OVERLAY_HOOKS_ACQUIRE;
       device_map_queues(device_data, pCreateInfo);
+      load_pipeline_cache(device_data);
+
+      if ((instance_data->params.gpu_frametime || instance_data->params.bound_by) &&
+          device_data->graphic_queue &&
+          device_data->graphic_queue->timestamp_valid_bits)
+         create_gpu_timer(device_data->graphic_queue);
+
+      if (instance_data->params.max_frames_ahead && device_data->timeline_semaphore) {
+         VkSemaphoreTypeCreateInfoKHR type_info = {};
+         type_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO_KHR;
+         type_info.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE_KHR;
+         type_info.initialValue = 0;
+         VkSemaphoreCreateInfo sem_info = {};
+         sem_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+         sem_info.pNext = &type_info;
+         for (auto queue : device_data->queues)
+            VK_CHECK(device_data->vtable.CreateSemaphore(device_data->device, &sem_info,
+                                                         NULL, &queue->frames_ahead_timeline));
+         device_data->frames_ahead = true;
+      }
 
       init_gpu_stats(device_data->properties.vendorID, instance_data->params);
       init_system_info();
+
+      if (instance_data->params.headless) {
+         device_data->headless = new swapchain_data();
+         device_data->headless->device = device_data;
+      }
    }
 
    return result;
 }
 
+#ifndef NDEBUG
+/* Time spent resolving entry points in find_hook(), printed at device
+ * destruction.
+ */
+static std::atomic<uint64_t> hook_lookups, hook_lookup_ns;
+#endif
+
 static void overlay_DestroyDevice(
     VkDevice                                    device,
     const VkAllocationCallbacks*                pAllocator)
 {
    struct device_data *device_data = FIND(struct device_data, device);
-   if (!is_blacklisted())
+   if (!is_blacklisted()) {
+      for (auto queue : device_data->queues) {
+         destroy_gpu_timer(queue);
+         device_data->vtable.DestroySemaphore(device, queue->frames_ahead_timeline, NULL);
+      }
       device_unmap_queues(device_data);
+   }
+   destroy_device_fonts(device_data);
+   if (device_data->headless) {
+      if (!device_data->has_swapchain && loggingOn)
+         stop_headless_logging();
+      delete device_data->headless;
+   }
+   for (auto block : device_data->memory_blocks)
+      free_device_block(device_data, block);
+   device_data->memory_blocks.clear();
+   device_data->vtable.DestroyPipelineCache(device, device_data->pipeline_cache, NULL);
    device_data->vtable.DestroyDevice(device, pAllocator);
    destroy_device_data(device_data);
+#ifndef NDEBUG
+   std::cerr << "MANGOHUD: " << hook_lookups << " entry point lookups took "
+             << hook_lookup_ns / 1000 << " us\n";
+   if (counted_commands) {
+      std::cerr << "MANGOHUD: counting " << counted_commands << " commands took "
+                << counted_command_ns / 1000 << " us, "
+                << counted_command_ns / counted_commands << " ns each\n";
+   }
+#endif
 }
 
 static VkResult overlay_CreateInstance(
@@ -2676,6 +6321,16 @@ static VkResult overlay_CreateInstance(
    vk_load_instance_commands(instance_data->instance,
                              fpGetInstanceProcAddr,
                              &instance_data->vtable);
+
+   uint32_t api_version = pCreateInfo->pApplicationInfo ?
+      pCreateInfo->pApplicationInfo->apiVersion : VK_API_VERSION_1_0;
+   instance_data->api_version = api_version;
+   instance_data->properties2 = api_version >= VK_API_VERSION_1_1;
+   for (uint32_t i = 0; i < pCreateInfo->enabledExtensionCount; i++) {
+      if (!strcmp(pCreateInfo->ppEnabledExtensionNames[i],
+                  VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME))
+         instance_data->properties2 = true;
+   }
    instance_data_map_physical_devices(instance_data, true);
 
    if (!is_blacklisted()) {
@@ -2715,69 +6370,195 @@ static void overlay_DestroyInstance(
 
 extern "C" VK_LAYER_EXPORT VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL overlay_GetDeviceProcAddr(VkDevice dev,
                                                                              const char *funcName);
-static const struct {
+/* Every entry point we hook. HOOK is always handed out, OPTIONAL_HOOK only
+ * to devices that need its group, and CORE_HOOK even in blacklisted
+ * processes. ALIAS_HOOK is an optional hook under an extension's name of
+ * the command, see load_device_aliases().
+ */
+#define OVERLAY_HOOK_LIST(HOOK, OPTIONAL_HOOK, ALIAS_HOOK, CORE_HOOK) \
+   HOOK(GetDeviceProcAddr) \
+   \
+   OPTIONAL_HOOK(AllocateCommandBuffers, COMMAND_BUFFER) \
+   OPTIONAL_HOOK(FreeCommandBuffers, COMMAND_BUFFER) \
+   OPTIONAL_HOOK(ResetCommandBuffer, COMMAND_BUFFER) \
+   OPTIONAL_HOOK(BeginCommandBuffer, COMMAND_BUFFER) \
+   OPTIONAL_HOOK(EndCommandBuffer, COMMAND_BUFFER) \
+   OPTIONAL_HOOK(CmdExecuteCommands, COMMAND_BUFFER) \
+   \
+   OPTIONAL_HOOK(CmdDraw, DRAW) \
+   OPTIONAL_HOOK(CmdDrawIndexed, DRAW) \
+   OPTIONAL_HOOK(CmdDrawIndirect, DRAW) \
+   OPTIONAL_HOOK(CmdDrawIndexedIndirect, DRAW) \
+   OPTIONAL_HOOK(CmdDrawIndirectCount, DRAW) \
+   OPTIONAL_HOOK(CmdDrawIndexedIndirectCount, DRAW) \
+   ALIAS_HOOK(CmdDrawIndirectCountKHR, CmdDrawIndirectCount, DRAW) \
+   ALIAS_HOOK(CmdDrawIndexedIndirectCountKHR, CmdDrawIndexedIndirectCount, DRAW) \
+   ALIAS_HOOK(CmdDrawIndirectCountAMD, CmdDrawIndirectCount, DRAW) \
+   ALIAS_HOOK(CmdDrawIndexedIndirectCountAMD, CmdDrawIndexedIndirectCount, DRAW) \
+   OPTIONAL_HOOK(CmdDispatch, DRAW) \
+   OPTIONAL_HOOK(CmdDispatchIndirect, DRAW) \
+   OPTIONAL_HOOK(CmdDispatchBase, DRAW) \
+   ALIAS_HOOK(CmdDispatchBaseKHR, CmdDispatchBase, DRAW) \
+   OPTIONAL_HOOK(CmdBindPipeline, DRAW) \
+   OPTIONAL_HOOK(CmdBindDescriptorSets, DRAW) \
+   \
+   HOOK(CreateSwapchainKHR) \
+   HOOK(QueuePresentKHR) \
+   HOOK(DestroySwapchainKHR) \
+   OPTIONAL_HOOK(AcquireNextImageKHR, ACQUIRE) \
+   OPTIONAL_HOOK(AcquireNextImage2KHR, ACQUIRE) \
+   \
+   OPTIONAL_HOOK(QueueSubmit, QUEUE_SUBMIT) \
+   \
+   OPTIONAL_HOOK(WaitForFences, WAIT) \
+   OPTIONAL_HOOK(WaitSemaphores, WAIT) \
+   ALIAS_HOOK(WaitSemaphoresKHR, WaitSemaphores, WAIT) \
+   OPTIONAL_HOOK(QueueWaitIdle, WAIT) \
+   OPTIONAL_HOOK(DeviceWaitIdle, WAIT) \
+   OPTIONAL_HOOK(GetQueryPoolResults, WAIT) \
+   \
+   OPTIONAL_HOOK(CreateGraphicsPipelines, PIPELINE) \
+   OPTIONAL_HOOK(CreateComputePipelines, PIPELINE) \
+   OPTIONAL_HOOK(CreateShaderModule, PIPELINE) \
+   \
+   OPTIONAL_HOOK(AllocateMemory, MEMORY) \
+   OPTIONAL_HOOK(FreeMemory, MEMORY) \
+   \
+   CORE_HOOK(CreateDevice) \
+   CORE_HOOK(DestroyDevice) \
+   \
+   CORE_HOOK(CreateInstance) \
+   CORE_HOOK(DestroyInstance)
+
+static const struct hook {
    const char *name;
    void *ptr;
+   uint32_t hooks; /* enum overlay_hooks, 0 if always hooked */
+   bool core;      /* hooked in blacklisted processes too */
 } name_to_funcptr_map[] = {
-   { "vkGetDeviceProcAddr", (void *) overlay_GetDeviceProcAddr },
-#define ADD_HOOK(fn) { "vk" # fn, (void *) overlay_ ## fn }
-#define ADD_ALIAS_HOOK(alias, fn) { "vk" # alias, (void *) overlay_ ## fn }
-   ADD_HOOK(AllocateCommandBuffers),
-   ADD_HOOK(FreeCommandBuffers),
-   ADD_HOOK(ResetCommandBuffer),
-   ADD_HOOK(BeginCommandBuffer),
-   ADD_HOOK(EndCommandBuffer),
-   ADD_HOOK(CmdExecuteCommands),
-
-   ADD_HOOK(CreateSwapchainKHR),
-   ADD_HOOK(QueuePresentKHR),
-   ADD_HOOK(DestroySwapchainKHR),
-
-   ADD_HOOK(QueueSubmit),
-
-   ADD_HOOK(CreateDevice),
-   ADD_HOOK(DestroyDevice),
-
-   ADD_HOOK(CreateInstance),
-   ADD_HOOK(DestroyInstance),
+#define ADD_HOOK(fn) { "vk" # fn, (void *) overlay_ ## fn, 0, false },
+#define ADD_OPTIONAL_HOOK(fn, group) { "vk" # fn, (void *) overlay_ ## fn, OVERLAY_HOOKS_ ## group, false },
+#define ADD_ALIAS_HOOK(alias, fn, group) { "vk" # alias, (void *) overlay_ ## fn, OVERLAY_HOOKS_ ## group, false },
+#define ADD_CORE_HOOK(fn) { "vk" # fn, (void *) overlay_ ## fn, 0, true },
+   OVERLAY_HOOK_LIST(ADD_HOOK, ADD_OPTIONAL_HOOK, ADD_ALIAS_HOOK, ADD_CORE_HOOK)
 #undef ADD_HOOK
+#undef ADD_OPTIONAL_HOOK
+#undef ADD_ALIAS_HOOK
+#undef ADD_CORE_HOOK
 };
 
-static void *find_ptr(const char *name)
-{
-    std::string f(name);
+/* Perfect hash over the hook names, computed at compile time: a seed for
+ * which every name lands in its own slot of hook_table. A lookup is one
+ * hash of the requested name and at most one strcmp.
+ */
+static constexpr const char *hook_names[] = {
+#define HOOK_NAME(fn) "vk" # fn,
+#define OPTIONAL_HOOK_NAME(fn, group) "vk" # fn,
+#define ALIAS_HOOK_NAME(alias, fn, group) "vk" # alias,
+   OVERLAY_HOOK_LIST(HOOK_NAME, OPTIONAL_HOOK_NAME, ALIAS_HOOK_NAME, HOOK_NAME)
+#undef HOOK_NAME
+#undef OPTIONAL_HOOK_NAME
+#undef ALIAS_HOOK_NAME
+};
+static constexpr uint32_t n_hooks = ARRAY_SIZE(hook_names);
+static constexpr uint32_t hook_table_size = 128; /* power of two */
+static_assert(n_hooks == ARRAY_SIZE(name_to_funcptr_map), "hook lists out of sync");
+static_assert(n_hooks < hook_table_size / 2, "hook_table_size too small");
 
-    if (is_blacklisted() && (f != "vkCreateInstance" && f != "vkDestroyInstance" && f != "vkCreateDevice" && f != "vkDestroyDevice"))
-    {
-        return NULL;
-    }
+static constexpr uint32_t hook_hash(const char *name, uint32_t seed)
+{
+   /* FNV-1a, with the high half folded in: the multiply only carries low
+    * bits upwards, so the slot bits would barely depend on the seed.
+    */
+   uint32_t h = seed;
+   while (*name) {
+      h ^= (unsigned char)*name++;
+      h *= 16777619u;
+   }
+   return h ^ (h >> 16);
+}
 
-   for (uint32_t i = 0; i < ARRAY_SIZE(name_to_funcptr_map); i++) {
-      if (strcmp(name, name_to_funcptr_map[i].name) == 0)
-         return name_to_funcptr_map[i].ptr;
+static constexpr bool hook_seed_works(uint32_t seed)
+{
+   bool used[hook_table_size] = {};
+   for (uint32_t i = 0; i < n_hooks; i++) {
+      uint32_t slot = hook_hash(hook_names[i], seed) & (hook_table_size - 1);
+      if (used[slot])
+         return false;
+      used[slot] = true;
    }
+   return true;
+}
 
-   return NULL;
+/* The first seed from the FNV offset basis up that works. Searching for it
+ * at compile time runs into the compilers' constexpr evaluation limits, so
+ * it's found offline and only checked here: after changing the hook list,
+ * bump the seed until the assert passes.
+ */
+static constexpr uint32_t hook_seed = 2166137299u;
+static_assert(hook_seed_works(hook_seed), "hook_seed collides, pick a new one");
+
+struct hook_table {
+   uint8_t index[hook_table_size]; /* into name_to_funcptr_map, 0xff if empty */
+};
+
+static constexpr struct hook_table build_hook_table()
+{
+   struct hook_table table = {};
+   for (uint32_t i = 0; i < hook_table_size; i++)
+      table.index[i] = 0xff;
+   for (uint32_t i = 0; i < n_hooks; i++)
+      table.index[hook_hash(hook_names[i], hook_seed) & (hook_table_size - 1)] = i;
+   return table;
+}
+
+static constexpr struct hook_table hook_table = build_hook_table();
+
+static const struct hook *find_hook(const char *name)
+{
+#ifndef NDEBUG
+   uint64_t start = os_time_get_nano();
+#endif
+   const struct hook *hook = NULL;
+
+   uint8_t i = hook_table.index[hook_hash(name, hook_seed) & (hook_table_size - 1)];
+   if (i != 0xff && strcmp(name, hook_names[i]) == 0)
+      hook = &name_to_funcptr_map[i];
+
+   if (hook && !hook->core && is_blacklisted())
+      hook = NULL;
+
+#ifndef NDEBUG
+   hook_lookups++;
+   hook_lookup_ns += os_time_get_nano() - start;
+#endif
+   return hook;
 }
 
 extern "C" VK_LAYER_EXPORT VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL overlay_GetDeviceProcAddr(VkDevice dev,
                                                                              const char *funcName)
 {
-   void *ptr = find_ptr(funcName);
-   if (ptr) return reinterpret_cast<PFN_vkVoidFunction>(ptr);
+   const struct hook *hook = find_hook(funcName);
+   if (hook && !hook->hooks) return reinterpret_cast<PFN_vkVoidFunction>(hook->ptr);
 
    if (dev == NULL) return NULL;
 
    struct device_data *device_data = FIND(struct device_data, dev);
    if (device_data->vtable.GetDeviceProcAddr == NULL) return NULL;
-   return device_data->vtable.GetDeviceProcAddr(dev, funcName);
+   PFN_vkVoidFunction next = device_data->vtable.GetDeviceProcAddr(dev, funcName);
+
+   /* Commands of extensions or versions the device doesn't have stay NULL */
+   if (next && hook && (device_data->hooks & hook->hooks))
+      return reinterpret_cast<PFN_vkVoidFunction>(hook->ptr);
+   return next;
 }
 
 extern "C" VK_LAYER_EXPORT VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL overlay_GetInstanceProcAddr(VkInstance instance,
                                                                                const char *funcName)
 {
-   void *ptr = find_ptr(funcName);
-   if (ptr) return reinterpret_cast<PFN_vkVoidFunction>(ptr);
+   /* Optional hooks are per device, those only go through GetDeviceProcAddr */
+   const struct hook *hook = find_hook(funcName);
+   if (hook && !hook->hooks) return reinterpret_cast<PFN_vkVoidFunction>(hook->ptr);
 
    if (instance == NULL) return NULL;
 
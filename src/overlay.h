@@ -3,17 +3,26 @@
 #include "imgui.h"
 #include "overlay_params.h"
 #include "iostats.h"
+#include "frame_history.h"
 
 struct frame_stat {
    uint64_t stats[OVERLAY_PLOTS_MAX];
 };
 
+enum frame_bound {
+   FRAME_BOUND_UNKNOWN,
+   FRAME_BOUND_CPU,
+   FRAME_BOUND_GPU,
+   FRAME_BOUND_PRESENT, /* waiting for the display: vsync, fps_limit */
+   FRAME_BOUND_COUNT,
+};
+
 struct swapchain_stats {
    uint64_t n_frames;
-   enum overlay_plots stat_selector;
-   double time_dividor;
-   struct frame_stat stats_min, stats_max;
-   struct frame_stat frames_stats[200];
+   /* Frame time in ms and compile_time in us of the last frames, as many
+    * as the frame_history param asks for.
+    */
+   frame_history<OVERLAY_PLOTS_MAX> history;
 
    ImFont* font1 = nullptr;
    std::string time;
@@ -36,6 +45,74 @@ struct swapchain_stats {
    std::string engineName;
    std::string engineVersion;
    std::string deviceName;
+   uint64_t gpu_frametime; /* us, busy time of the last timed frame */
+   uint64_t present_latency; /* us, from present to its completion */
+
+   /* bound_by inputs of the last frame, us. Frames are only classified
+    * where present_wait is tracked.
+    */
+   bool present_wait_tracked;
+   uint64_t present_wait; /* blocked in acquire, present and fps_limit */
+   uint64_t render_cpu;   /* CPU time of the presenting thread */
+   uint64_t last_render_cpu;
+   enum frame_bound frame_bound; /* of the last frame */
+   enum frame_bound bound;       /* of most frames in the last fps period */
+   unsigned n_frames_bound[FRAME_BOUND_COUNT];
+
+   /* compile_stats, compile_time in us and n_* of the last frame */
+   uint64_t compile_time;
+   uint32_t n_compiles, n_cache_hits;
+   uint64_t total_compiles, total_cache_hits;
+
+   /* process_vram, sampled every fps_sampling_period. Sizes in bytes,
+    * budget and usage are 0 without VK_EXT_memory_budget.
+    */
+   uint64_t process_vram; /* allocated by the application, device local */
+   uint64_t vram_usage, vram_budget;
+   float heap_pressure; /* usage / budget of the fullest device local heap */
+   double allocations_per_sec;
+   uint64_t last_n_allocations;
+   uint64_t last_memory_update;
+
+   /* submit_stats of the last frame, driver_time in us */
+   uint64_t n_submits, n_submit_batches, n_command_buffers;
+   uint64_t driver_time;
+
+   /* draw_stats of the last frame, commands of the submitted command
+    * buffers. Indirect draws count once.
+    */
+   uint64_t n_draws, n_dispatches, n_pipeline_binds, n_descriptor_binds;
+
+   /* wait_stats of the last frame, times in us. gpu_wait_time sums all
+    * threads, render_thread_wait is the presenting thread's share.
+    */
+   uint64_t n_gpu_waits, gpu_wait_time, render_thread_wait;
+
+   /* max_frames_ahead of the device, 0 when not limited, and the us the
+    * limiter held the application in the last frame: the input latency of
+    * the frames it kept from queuing up.
+    */
+   unsigned max_frames_ahead;
+   uint64_t frames_ahead_wait;
+
+   /* display_timing feedback of the latest present the display reported,
+    * us: the time since the previous one was shown, and how late it was
+    * shown against the refresh it was paced for.
+    */
+   bool display_timing;
+   uint64_t display_interval;
+   int64_t present_error;
+
+   /* self_overhead of the previous frame: CPU time the layer spent in the
+    * present, the part of it laying out the HUD and the GPU time of the
+    * overlay draw, us. Then the host memory the HUD holds, estimated, and
+    * the device memory the layer allocated, bytes. Last the percentage of
+    * frames so far that reused their recorded overlay commands.
+    */
+   bool self_overhead;
+   uint64_t layer_cpu_time, layer_layout_time, layer_gpu_time;
+   uint64_t layer_host_memory, layer_device_memory;
+   unsigned layer_cmd_reuse;
 };
 
 struct fps_limit {
@@ -48,6 +125,17 @@ struct fps_limit {
 
 extern struct fps_limit fps_limit_stats;
 
+/* Single textured quad covering the HUD, blends a HUD that was rendered
+ * offscreen over the frame.
+ */
+struct hud_quad {
+   ImDrawList list;
+   ImDrawList *lists[1];
+   ImDrawData draw_data;
+
+   hud_quad() : list(NULL) { lists[0] = &list; }
+};
+
 void position_layer(struct overlay_params& params, ImVec2 window_size);
 void render_imgui(swapchain_stats& data, struct overlay_params& params, ImVec2& window_size, bool is_vulkan);
 void update_hud_info(struct swapchain_stats& sw_stats, struct overlay_params& params, uint32_t vendorID);
@@ -57,3 +145,9 @@ void check_keybinds(struct overlay_params& params);
 void init_system_info(void);
 void FpsLimiter(struct fps_limit& stats);
 void imgui_custom_style(struct overlay_params& params);
+bool hud_refresh_due(const struct overlay_params& params, uint64_t& last_refresh);
+uint64_t hash_draw_data(ImDrawData *draw_data, uint64_t seed);
+void update_hud_quad(struct hud_quad& quad, ImDrawData *hud, ImTextureID texture, bool flip_y);
+const char *frame_bound_name(enum frame_bound bound);
+ImFontAtlas *get_shared_font_atlas(const struct overlay_params& params,
+                                   ImFont **font, ImFont **font_small);
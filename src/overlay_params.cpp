@@ -124,6 +124,93 @@ parse_no_display(const char *str)
    return strtol(str, NULL, 0) != 0;
 }
 
+static bool
+parse_gpu_frametime(const char *str)
+{
+   return strtol(str, NULL, 0) != 0;
+}
+
+static bool
+parse_present_latency(const char *str)
+{
+   return strtol(str, NULL, 0) != 0;
+}
+
+static bool
+parse_bound_by(const char *str)
+{
+   return strtol(str, NULL, 0) != 0;
+}
+
+static bool
+parse_compile_stats(const char *str)
+{
+   return strtol(str, NULL, 0) != 0;
+}
+
+static bool
+parse_process_vram(const char *str)
+{
+   return strtol(str, NULL, 0) != 0;
+}
+
+static bool
+parse_submit_stats(const char *str)
+{
+   return strtol(str, NULL, 0) != 0;
+}
+
+static bool
+parse_draw_stats(const char *str)
+{
+   return strtol(str, NULL, 0) != 0;
+}
+
+static bool
+parse_wait_stats(const char *str)
+{
+   return strtol(str, NULL, 0) != 0;
+}
+
+static bool
+parse_display_timing(const char *str)
+{
+   return strtol(str, NULL, 0) != 0;
+}
+
+static unsigned
+parse_frame_history(const char *str)
+{
+   long frames = strtol(str, NULL, 0);
+   if (frames < 200)
+      return 200;
+   if (frames > 100000)
+      return 100000;
+   return frames;
+}
+
+static bool
+parse_self_overhead(const char *str)
+{
+   return strtol(str, NULL, 0) != 0;
+}
+
+static enum overlay_param_headless
+parse_headless(const char *str)
+{
+   if (!strcmp(str, "submit") || !strcmp(str, "1"))
+      return HEADLESS_SUBMIT;
+   if (!strcmp(str, "wait"))
+      return HEADLESS_WAIT;
+   return HEADLESS_OFF;
+}
+
+static unsigned
+parse_max_frames_ahead(const char *str)
+{
+   return strtol(str, NULL, 0);
+}
+
 static unsigned
 parse_color(const char *str)
 {
@@ -182,6 +269,7 @@ parse_path(const char *str)
 #define parse_io_read(s) parse_unsigned(s)
 #define parse_io_write(s) parse_unsigned(s)
 #define parse_pci_dev(s) parse_str(s)
+#define parse_hud_refresh_rate(s) parse_unsigned(s)
 
 #define parse_crosshair_color(s) parse_color(s)
 #define parse_cpu_color(s) parse_color(s)
@@ -330,6 +418,20 @@ parse_overlay_config(struct overlay_params *params,
    params->control = -1;
    params->fps_limit = 0;
    params->vsync = -1;
+   params->hud_refresh_rate = 0;
+   params->gpu_frametime = false;
+   params->present_latency = false;
+   params->bound_by = false;
+   params->compile_stats = false;
+   params->process_vram = false;
+   params->submit_stats = false;
+   params->draw_stats = false;
+   params->wait_stats = false;
+   params->max_frames_ahead = 0;
+   params->display_timing = false;
+   params->headless = HEADLESS_OFF;
+   params->self_overhead = false;
+   params->frame_history = 200;
    params->gl_vsync = -2;
    params->crosshair_size = 30;
    params->offset_x = 0;
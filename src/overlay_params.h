@@ -78,6 +78,20 @@ typedef unsigned long KeySym;
    OVERLAY_PARAM_CUSTOM(alpha)                       \
    OVERLAY_PARAM_CUSTOM(log_duration)                \
    OVERLAY_PARAM_CUSTOM(pci_dev)                     \
+   OVERLAY_PARAM_CUSTOM(hud_refresh_rate)            \
+   OVERLAY_PARAM_CUSTOM(gpu_frametime)               \
+   OVERLAY_PARAM_CUSTOM(present_latency)             \
+   OVERLAY_PARAM_CUSTOM(bound_by)                    \
+   OVERLAY_PARAM_CUSTOM(compile_stats)               \
+   OVERLAY_PARAM_CUSTOM(process_vram)                \
+   OVERLAY_PARAM_CUSTOM(submit_stats)                \
+   OVERLAY_PARAM_CUSTOM(draw_stats)                  \
+   OVERLAY_PARAM_CUSTOM(wait_stats)                  \
+   OVERLAY_PARAM_CUSTOM(max_frames_ahead)            \
+   OVERLAY_PARAM_CUSTOM(display_timing)              \
+   OVERLAY_PARAM_CUSTOM(headless)                    \
+   OVERLAY_PARAM_CUSTOM(self_overhead)               \
+   OVERLAY_PARAM_CUSTOM(frame_history)               \
    OVERLAY_PARAM_CUSTOM(help)
 
 enum overlay_param_position {
@@ -87,8 +101,16 @@ enum overlay_param_position {
    LAYER_POSITION_BOTTOM_RIGHT,
 };
 
+/* What ends a frame of a device without swapchain */
+enum overlay_param_headless {
+   HEADLESS_OFF,
+   HEADLESS_SUBMIT,
+   HEADLESS_WAIT,
+};
+
 enum overlay_plots {
     OVERLAY_PLOTS_frame_timing,
+    OVERLAY_PLOTS_compile_time,
     OVERLAY_PLOTS_MAX,
 };
 
@@ -116,6 +138,20 @@ struct overlay_params {
    unsigned height;
    int offset_x, offset_y;
    unsigned vsync;
+   unsigned hud_refresh_rate; /* Hz, 0 redraws the HUD every frame */
+   bool gpu_frametime;
+   bool present_latency;
+   bool bound_by;
+   bool compile_stats;
+   bool process_vram;
+   bool submit_stats;
+   bool draw_stats;
+   bool wait_stats;
+   unsigned max_frames_ahead;
+   bool display_timing;
+   enum overlay_param_headless headless;
+   bool self_overhead;
+   unsigned frame_history; /* frames, rounded up to a power of two */
    int gl_vsync;
    int log_duration;
    unsigned crosshair_color, cpu_color, gpu_color, vram_color, ram_color, engine_color, io_color, frametime_color, background_color, text_color;
@@ -0,0 +1,87 @@
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+#include <new>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <utility>
+
+/* Counters bumped from many threads, read by the present path.
+ *
+ * Every thread counts into its own block, so adding is a relaxed load and
+ * store with no read-modify-write. Blocks are cache line aligned and
+ * sized, two threads never write to the same line. A thread's
+ * block is registered under a mutex the first time it counts, after that
+ * it is found in a small thread_local cache keyed by the counters' id
+ * (not their address, which a later instance may reuse). Reading sums the
+ * blocks of every thread that ever counted; blocks are only freed with the
+ * counters themselves, threads that exit just stop updating theirs.
+ */
+template <unsigned N>
+class thread_counters
+{
+public:
+   thread_counters() : id(next_id()) {}
+
+   ~thread_counters()
+   {
+      for (auto b : blocks) {
+         b->~block();
+         free(b);
+      }
+   }
+
+   void add(unsigned counter, uint64_t value)
+   {
+      std::atomic<uint64_t> &v = local()->values[counter];
+      v.store(v.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+   }
+
+   uint64_t sum(unsigned counter)
+   {
+      std::lock_guard<std::mutex> lk(lock);
+      uint64_t total = 0;
+      for (auto b : blocks)
+         total += b->values[counter].load(std::memory_order_relaxed);
+      return total;
+   }
+
+private:
+   /* C++14 new doesn't honour the alignment, see local() */
+   struct alignas(64) block {
+      std::atomic<uint64_t> values[N];
+   };
+
+   static uint64_t next_id()
+   {
+      static std::atomic<uint64_t> ids;
+      return ++ids;
+   }
+
+   struct block *local()
+   {
+      static thread_local std::vector<std::pair<uint64_t, void *>> cache;
+      for (auto &entry : cache) {
+         if (entry.first == id)
+            return static_cast<struct block *>(entry.second);
+      }
+
+      void *mem;
+      if (posix_memalign(&mem, alignof(block), sizeof(block)))
+         throw std::bad_alloc();
+      struct block *b = new (mem) block();
+      for (unsigned i = 0; i < N; i++)
+         b->values[i].store(0, std::memory_order_relaxed);
+      {
+         std::lock_guard<std::mutex> lk(lock);
+         blocks.push_back(b);
+      }
+      cache.emplace_back(id, b);
+      return b;
+   }
+
+   const uint64_t id;
+   std::vector<struct block *> blocks;
+   std::mutex lock; /* guards blocks */
+};